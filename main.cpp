@@ -3,13 +3,33 @@
 #include "imgui_impl_sdl2.h"
 #include <SDL.h>
 #include <iostream>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <random>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <regex>
 #include <sstream>
 #include <algorithm>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <memory_resource>
+#include <new>
 
 #include <boost/json.hpp>
 #include <boost/json/src.hpp>
@@ -24,11 +44,30 @@ namespace json = boost::json;
 
 #include <boost/asio/connect.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/signal_set.hpp>
 #include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/ssl.hpp>
 #include <boost/beast/version.hpp>
+#include <boost/beast/zlib.hpp>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <ctime>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <list>
+#include <map>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 namespace beast = boost::beast;
 namespace http = beast::http;
@@ -37,9 +76,560 @@ namespace ssl = net::ssl;
 using tcp = net::ip::tcp;
 #endif
 
+struct MessageLayout;
+
+// Heap use by subsystem. Each allocation is charged to its thread's current
+// tag, set with MemTagScope, and carries its size and tag in a header so
+// that freeing it, on any thread, credits the same tag.
+enum class MemTag : std::uint8_t { Other, History, Render, ImGui, Network, Json, Search, Recall, Count };
+const char* const kMemTagNames[] = {"other", "history", "render", "imgui", "network", "json", "search", "recall"};
+
+// One cache line per tag so threads working under different tags don't
+// contend.
+struct alignas(64) MemTagStats {
+    std::atomic<std::int64_t> liveBytes{0};
+    std::atomic<std::int64_t> peakBytes{0};
+    std::atomic<std::uint64_t> allocations{0};
+};
+
+MemTagStats g_memTags[(int)MemTag::Count];
+thread_local MemTag g_memTag = MemTag::Other;
+
+struct MemTagScope {
+    MemTag previous;
+    explicit MemTagScope(MemTag tag) : previous(g_memTag) { g_memTag = tag; }
+    ~MemTagScope() { g_memTag = previous; }
+    MemTagScope(const MemTagScope&) = delete;
+    MemTagScope& operator=(const MemTagScope&) = delete;
+};
+
+// Keeps the block behind it at malloc's alignment.
+struct alignas(16) AllocHeader {
+    std::size_t size;
+    MemTag tag;
+};
+
+void* TaggedAlloc(std::size_t size, MemTag tag) noexcept {
+    auto* header = static_cast<AllocHeader*>(std::malloc(sizeof(AllocHeader) + size));
+    if (!header)
+        return nullptr;
+    header->size = size;
+    header->tag = tag;
+    MemTagStats& stats = g_memTags[(int)tag];
+    stats.allocations.fetch_add(1, std::memory_order_relaxed);
+    std::int64_t live = stats.liveBytes.fetch_add(size, std::memory_order_relaxed) + (std::int64_t)size;
+    std::int64_t peak = stats.peakBytes.load(std::memory_order_relaxed);
+    while (live > peak && !stats.peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+    return header + 1;
+}
+
+void TaggedFree(void* p) noexcept {
+    if (!p)
+        return;
+    auto* header = static_cast<AllocHeader*>(p) - 1;
+    g_memTags[(int)header->tag].liveBytes.fetch_sub(header->size, std::memory_order_relaxed);
+    std::free(header);
+}
+
+// Global operator new calls made by each thread. The UI thread's count per
+// frame is shown next to the API key; with nothing streaming it should
+// stay at 0.
+thread_local std::uint64_t g_threadHeapAllocations = 0;
+
+void* operator new(std::size_t size) {
+    g_threadHeapAllocations++;
+    for (;;) {
+        if (void* p = TaggedAlloc(size, g_memTag))
+            return p;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+void operator delete(void* p) noexcept { TaggedFree(p); }
+void operator delete(void* p, std::size_t) noexcept { TaggedFree(p); }
+
+// Every tag's counters at one moment, with the allocation rate since the
+// report before it.
+struct MemoryReport {
+    std::chrono::steady_clock::time_point taken;
+    std::int64_t liveBytes[(int)MemTag::Count] = {};
+    std::int64_t peakBytes[(int)MemTag::Count] = {};
+    std::uint64_t allocations[(int)MemTag::Count] = {};
+    double allocationsPerSec[(int)MemTag::Count] = {};
+};
+
+MemoryReport TakeMemoryReport(const MemoryReport& previous) {
+    MemoryReport report;
+    report.taken = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(report.taken - previous.taken).count();
+    for (int i = 0; i < (int)MemTag::Count; i++) {
+        report.liveBytes[i] = g_memTags[i].liveBytes.load(std::memory_order_relaxed);
+        report.peakBytes[i] = g_memTags[i].peakBytes.load(std::memory_order_relaxed);
+        report.allocations[i] = g_memTags[i].allocations.load(std::memory_order_relaxed);
+        if (previous.taken != std::chrono::steady_clock::time_point{} && seconds > 0.0)
+            report.allocationsPerSec[i] = (report.allocations[i] - previous.allocations[i]) / seconds;
+    }
+    return report;
+}
+
+// Message text that only grows at the end, as streamed replies do. It is
+// kept in chunks, each at least as large as everything before it, so an
+// append copies only the new text. Appended bytes are never rewritten: a
+// Snapshot taken under the history lock can still be read after the lock
+// is released while appends continue. View() merges the chunks when a
+// caller needs one contiguous string, and keeps the merged chunk.
+class MessageText {
+public:
+    // The text as it was when taken, sharing the chunks.
+    struct Snapshot {
+        std::vector<std::pair<std::shared_ptr<const char[]>, size_t>> chunks;
+
+        template <class F>
+        void ForEach(F&& f) const {
+            for (const auto& [data, size] : chunks)
+                f(std::string_view(data.get(), size));
+        }
+
+        std::string ToString() const {
+            std::string out;
+            ForEach([&](std::string_view s) { out.append(s.data(), s.size()); });
+            return out;
+        }
+    };
+
+    MessageText() = default;
+    MessageText(std::string_view s) { Append(s); }
+    MessageText(const std::string& s) : MessageText(std::string_view(s)) {}
+    MessageText(const char* s) : MessageText(std::string_view(s)) {}
+    // A copy gets chunks of its own; sharing them would let both copies
+    // append into the same spare room.
+    MessageText(const MessageText& other) : MessageText(other.View()) {}
+    MessageText(MessageText&& other) noexcept
+        : chunks(std::move(other.chunks)), length(std::exchange(other.length, 0)) {}
+    MessageText& operator=(const MessageText& other) {
+        if (this != &other)
+            *this = MessageText(other);
+        return *this;
+    }
+    MessageText& operator=(MessageText&& other) noexcept {
+        chunks = std::move(other.chunks);
+        length = std::exchange(other.length, 0);
+        return *this;
+    }
+
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+
+    void Append(std::string_view s) {
+        if (s.empty())
+            return;
+        if (!chunks.empty()) {
+            Chunk& last = chunks.back();
+            size_t n = std::min(s.size(), last.capacity - last.size);
+            std::memcpy(last.data.get() + last.size, s.data(), n);
+            last.size += n;
+            length += n;
+            s.remove_prefix(n);
+            if (s.empty())
+                return;
+        }
+        Chunk& chunk = AddChunk(std::max({s.size(), length, kMinChunk}));
+        std::memcpy(chunk.data.get(), s.data(), s.size());
+        chunk.size = s.size();
+        length += s.size();
+    }
+
+    std::string_view View() const {
+        if (chunks.size() > 1) {
+            // Room to double before the next merge keeps the copying
+            // amortized over the appends.
+            MemTagScope tag(MemTag::History);
+            Chunk merged{std::shared_ptr<char[]>(new char[2 * length]), 0, 2 * length};
+            for (const Chunk& c : chunks) {
+                std::memcpy(merged.data.get() + merged.size, c.data.get(), c.size);
+                merged.size += c.size;
+            }
+            chunks.clear();
+            chunks.push_back(std::move(merged));
+        }
+        return chunks.empty() ? std::string_view() : std::string_view(chunks[0].data.get(), length);
+    }
+
+    Snapshot Share() const {
+        Snapshot snapshot;
+        snapshot.chunks.reserve(chunks.size());
+        for (const Chunk& c : chunks)
+            snapshot.chunks.emplace_back(c.data, c.size);
+        return snapshot;
+    }
+
+    size_t HeapBytes() const {
+        size_t bytes = chunks.capacity() * sizeof(Chunk);
+        for (const Chunk& c : chunks)
+            bytes += c.capacity;
+        return bytes;
+    }
+
+private:
+    static constexpr size_t kMinChunk = 64;
+
+    struct Chunk {
+        std::shared_ptr<char[]> data;
+        size_t size = 0;
+        size_t capacity = 0;
+    };
+
+    Chunk& AddChunk(size_t capacity) {
+        chunks.push_back({std::shared_ptr<char[]>(new char[capacity]), 0, capacity});
+        return chunks.back();
+    }
+
+    mutable std::vector<Chunk> chunks; // View() merges them in place
+    size_t length = 0;
+};
+
 struct ChatMessage {
     std::string role;
-    std::string content;
+    MessageText content;
+    std::string model; // which route answered, for assistant replies
+    bool cached = false;
+
+    ChatMessage() = default;
+    ChatMessage(std::string role, std::string_view content, std::string model = "", bool cached = false)
+        : role(std::move(role)), content(content), model(std::move(model)), cached(cached) {}
+
+    // This message as a serialized {"role","content"} object, built on first
+    // use and dropped when the content changes. Request bodies share it
+    // instead of copying the conversation for every send.
+    mutable std::shared_ptr<const std::string> fragment;
+    // The same with a cache_control breakpoint, for the turn before a prompt.
+    mutable std::shared_ptr<const std::string> breakpointFragment;
+    // Prose and highlighted code as RenderMessage draws them, built on first
+    // draw and dropped with `fragment` when the content changes.
+    mutable std::shared_ptr<const MessageLayout> layout;
+};
+
+// One message in the conversation tree. Editing a prompt or regenerating a
+// reply adds a sibling rather than replacing anything, so branches share
+// every message, with its cached fragment and layout, up to where they
+// diverge. Nodes are never freed while the app runs; requests and the UI
+// hold plain pointers to them.
+struct MessageNode {
+    ChatMessage message;
+    MessageNode* parent = nullptr;
+    std::vector<std::unique_ptr<MessageNode>> children;
+    size_t activeChild = 0; // the branch shown below this node
+    size_t depth = 0;       // messages from the root, this one included
+    std::uint32_t id = 0;   // creation order, from 1
+    // For a prompt that was sent, the path index its request started at;
+    // later prompts on the branch continue from it. -1 if never sent.
+    std::int32_t contextStart = -1;
+};
+
+// The active branch is found by following activeChild from the root, so
+// switching to a sibling is one assignment and each node remembers which
+// of its descendants was last shown. Guarded by historyMutex.
+struct Conversation {
+    MessageNode root; // holds no message
+    std::uint32_t nextId = 1;
+
+    // Adds `m` under `parent` and makes it the parent's active child.
+    MessageNode* Add(MessageNode* parent, ChatMessage m) {
+        auto node = std::make_unique<MessageNode>();
+        node->message = std::move(m);
+        node->parent = parent;
+        node->depth = parent->depth + 1;
+        node->id = nextId++;
+        parent->activeChild = parent->children.size();
+        parent->children.push_back(std::move(node));
+        return parent->children.back().get();
+    }
+
+    // Makes the branch through `node` the active one.
+    void Show(const MessageNode* node) {
+        for (; node->parent; node = node->parent) {
+            MessageNode* parent = node->parent;
+            for (size_t i = 0; i < parent->children.size(); i++)
+                if (parent->children[i].get() == node)
+                    parent->activeChild = i;
+        }
+    }
+
+    MessageNode* Leaf() {
+        MessageNode* node = &root;
+        while (!node->children.empty())
+            node = node->children[node->activeChild].get();
+        return node;
+    }
+
+    // Messages on the active branch, oldest first.
+    template <class F>
+    void ForEachActive(F&& f) {
+        for (MessageNode* node = &root; !node->children.empty();) {
+            node = node->children[node->activeChild].get();
+            f(*node);
+        }
+    }
+
+    // Messages from the first one down to `node`, whichever branch it is on.
+    std::vector<const MessageNode*> PathTo(const MessageNode* node) const {
+        std::vector<const MessageNode*> path(node->depth);
+        for (; node != &root; node = node->parent)
+            path[node->depth - 1] = node;
+        return path;
+    }
+
+    // Every message on every branch, below `node` if given.
+    template <class F>
+    void ForEachNode(F&& f, const MessageNode* node = nullptr) const {
+        for (const auto& child : (node ? node : &root)->children) {
+            f(*child);
+            ForEachNode(f, child.get());
+        }
+    }
+};
+
+// Calls f(begin, end) for each word of `text`: a run of ASCII letters and
+// digits, underscores and non-ASCII bytes.
+template <class F>
+void ForEachWord(std::string_view text, F&& f) {
+    auto isWord = [](unsigned char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+    };
+    size_t i = 0;
+    while (i < text.size()) {
+        while (i < text.size() && !isWord(text[i]))
+            i++;
+        size_t begin = i;
+        while (i < text.size() && isWord(text[i]))
+            i++;
+        if (i > begin)
+            f(begin, i);
+    }
+}
+
+char FoldChar(char c) { return c >= 'A' && c <= 'Z' ? char(c - 'A' + 'a') : c; }
+
+// Search terms are words with ASCII letters lower-cased.
+std::string FoldWord(std::string_view word) {
+    std::string folded(word);
+    for (char& c : folded)
+        c = FoldChar(c);
+    return folded;
+}
+
+bool IsSearchTerm(std::string_view word, const std::vector<std::string>& terms) {
+    for (const std::string& term : terms)
+        if (term.size() == word.size() &&
+            std::equal(word.begin(), word.end(), term.begin(), [](char a, char b) { return FoldChar(a) == b; }))
+            return true;
+    return false;
+}
+
+// Inverted index over every message on every branch: where each search
+// term occurs, ordered by message creation and word position. Messages are
+// indexed when added and streamed replies as their text arrives, each word
+// once it is complete. Guarded by historyMutex.
+struct SearchIndex {
+    static constexpr size_t kMaxWordLength = 64; // longer words are skipped
+
+    struct Posting {
+        std::uint32_t node;     // MessageNode::id
+        std::uint32_t position; // word number within the message
+        std::uint32_t offset;   // byte offset within the message
+    };
+    struct Result {
+        const MessageNode* node;
+        std::uint32_t offset; // of the first match
+    };
+
+    std::unordered_map<std::string, std::vector<Posting>> postings;
+    std::vector<const MessageNode*> nodes; // by id
+    // How much of each message, by id, has been indexed.
+    std::vector<std::uint32_t> indexedBytes;
+    std::vector<std::uint32_t> indexedWords;
+    std::uint64_t generation = 0; // bumped whenever postings are added
+
+    // Indexes the text `node` gained since the last call. Unless `final`, a
+    // word running to the end of the text is left for later, as the rest of
+    // it may still be streaming in.
+    void Index(const MessageNode& node, bool final) {
+        MemTagScope tag(MemTag::Search);
+        if (node.id >= nodes.size()) {
+            nodes.resize(node.id + 1);
+            indexedBytes.resize(node.id + 1);
+            indexedWords.resize(node.id + 1);
+        }
+        nodes[node.id] = &node;
+        std::uint32_t& bytes = indexedBytes[node.id];
+        std::uint32_t& words = indexedWords[node.id];
+        std::string_view rest = node.message.content.View().substr(bytes);
+        size_t consumed = 0;
+        ForEachWord(rest, [&](size_t begin, size_t end) {
+            if (!final && end == rest.size())
+                return;
+            if (end - begin <= kMaxWordLength)
+                Add(FoldWord(rest.substr(begin, end - begin)),
+                    {node.id, words, bytes + (std::uint32_t)begin});
+            words++;
+            consumed = end;
+        });
+        bytes += (std::uint32_t)(final ? rest.size() : consumed);
+    }
+
+    // Messages with every word of `query`, newest first. A query in double
+    // quotes matches the words as a phrase.
+    std::vector<Result> Query(std::string_view query, size_t limit) const {
+        std::vector<Result> results;
+        bool phrase = query.size() > 1 && query.front() == '"';
+        std::vector<const std::vector<Posting>*> lists;
+        bool missing = false;
+        ForEachWord(query, [&](size_t begin, size_t end) {
+            auto it = postings.find(FoldWord(query.substr(begin, end - begin)));
+            if (it == postings.end())
+                missing = true;
+            else
+                lists.push_back(&it->second);
+        });
+        if (missing || lists.empty())
+            return results;
+
+        // Walk the rarest word's postings and look the others up around
+        // each one.
+        size_t rarest = 0;
+        for (size_t i = 1; i < lists.size(); i++)
+            if (lists[i]->size() < lists[rarest]->size())
+                rarest = i;
+        auto find = [](const std::vector<Posting>& list, std::uint32_t node, std::uint32_t position) {
+            auto it = std::lower_bound(list.begin(), list.end(), std::make_pair(node, position),
+                                       [](const Posting& p, const std::pair<std::uint32_t, std::uint32_t>& key) {
+                                           return p.node < key.first ||
+                                                  (p.node == key.first && p.position < key.second);
+                                       });
+            return it != list.end() && it->node == node ? &*it : nullptr;
+        };
+        const std::vector<Posting>& candidates = *lists[rarest];
+        std::uint32_t lastNode = 0;
+        for (auto it = candidates.rbegin(); it != candidates.rend() && results.size() < limit; ++it) {
+            if (it->node == lastNode)
+                continue;
+            const Posting* first = nullptr;
+            bool match = true;
+            for (size_t i = 0; i < lists.size() && match; i++) {
+                if (phrase) {
+                    std::uint32_t position = it->position + (std::uint32_t)i - (std::uint32_t)rarest;
+                    const Posting* p = it->position + i >= rarest ? find(*lists[i], it->node, position) : nullptr;
+                    match = p && p->position == position;
+                    if (i == 0)
+                        first = p;
+                } else {
+                    const Posting* p = find(*lists[i], it->node, 0);
+                    match = p != nullptr;
+                    if (p && (!first || p->offset < first->offset))
+                        first = p;
+                }
+            }
+            if (!match)
+                continue;
+            lastNode = it->node;
+            results.push_back({nodes[it->node], first->offset});
+        }
+        return results;
+    }
+
+private:
+    void Add(std::string term, const Posting& posting) {
+        std::vector<Posting>& list = postings[std::move(term)];
+        // Streamed replies can be indexed after newer messages; keep the
+        // list in (node, position) order for Query's binary searches.
+        if (list.empty() || list.back().node <= posting.node) {
+            list.push_back(posting);
+        } else {
+            auto it = std::upper_bound(list.begin(), list.end(), posting, [](const Posting& a, const Posting& b) {
+                return a.node < b.node || (a.node == b.node && a.position < b.position);
+            });
+            list.insert(it, posting);
+        }
+        generation++;
+    }
+};
+
+using MessageFragments = std::vector<std::shared_ptr<const std::string>>;
+
+// Appends `s` to `out` as a quoted, escaped JSON string, without building a
+// json::value first.
+void AppendJsonString(std::string& out, std::string_view s) {
+    json::serializer sr;
+    sr.reset(json::string_view(s.data(), s.size()));
+    char buf[512];
+    while (!sr.done()) {
+        json::string_view chunk = sr.read(buf, sizeof(buf));
+        out.append(chunk.data(), chunk.size());
+    }
+}
+
+// A breakpoint marks the end of a prefix the provider may cache; the content
+// then has to be sent as an array of parts.
+std::shared_ptr<const std::string> MessageFragment(const std::string& role, std::string_view content,
+                                                   bool cacheBreakpoint = false) {
+    MemTagScope tag(MemTag::Json);
+    // Written straight into one string sized for the common case of no
+    // escapes, rather than through a json::object and json::serialize.
+    std::string out;
+    out.reserve(role.size() + content.size() + 96);
+    out += "{\"role\":";
+    AppendJsonString(out, role);
+    if (!cacheBreakpoint) {
+        out += ",\"content\":";
+        AppendJsonString(out, content);
+    } else {
+        out += ",\"content\":[{\"type\":\"text\",\"text\":";
+        AppendJsonString(out, content);
+        out += ",\"cache_control\":{\"type\":\"ephemeral\"}}]";
+    }
+    out += '}';
+    return std::make_shared<const std::string>(std::move(out));
+}
+
+// Called with the history lock held.
+const std::shared_ptr<const std::string>& FragmentFor(const ChatMessage& m) {
+    if (!m.fragment)
+        m.fragment = MessageFragment(m.role, m.content.View());
+    return m.fragment;
+}
+
+// Called with the history lock held.
+const std::shared_ptr<const std::string>& BreakpointFragmentFor(const ChatMessage& m) {
+    if (!m.breakpointFragment)
+        m.breakpointFragment = MessageFragment(m.role, m.content.View(), true);
+    return m.breakpointFragment;
+}
+
+const char* const kSystemPrompt = "You are a helpful assistant.";
+
+const std::shared_ptr<const std::string>& SystemPromptFragment() {
+    static const auto fragment = MessageFragment("system", kSystemPrompt);
+    return fragment;
+}
+
+const std::shared_ptr<const std::string>& SystemPromptBreakpoint() {
+    static const auto fragment = MessageFragment("system", kSystemPrompt, true);
+    return fragment;
+}
+
+// Scratch memory for one UI frame, released all at once when the frame
+// ends. Frame-scoped containers take `&arena.resource`; past kSize bytes it
+// falls back to the heap, which then shows up in the allocation count.
+struct FrameArena {
+    static constexpr size_t kSize = 256 * 1024;
+    std::unique_ptr<std::byte[]> buffer{new std::byte[kSize]};
+    std::pmr::monotonic_buffer_resource resource{buffer.get(), kSize};
+
+    void Reset() { resource.release(); }
 };
 
 struct CodeBlock {
@@ -50,6 +640,7 @@ struct CodeBlock {
 struct HighlightRule {
     std::regex pattern;
     ImVec4 color;
+    int group = 0; // submatch to colour; std::regex has no lookbehind
 };
 
 struct Highlight {
@@ -62,144 +653,2308 @@ struct Highlight {
     }
 };
 
-struct AppContext {
-    std::vector<ChatMessage> history;
-    std::mutex historyMutex;
-    char inputBuffer[2048];
-    char apiKeyBuffer[128];
-    bool isWaiting;
-    bool scrollToBottom;
-    
-    AppContext() : isWaiting(false), scrollToBottom(false) {
-        memset(inputBuffer, 0, sizeof(inputBuffer));
-        memset(apiKeyBuffer, 0, sizeof(apiKeyBuffer));
-    }
-    
-    void AddMessage(std::string role, std::string content) {
-        std::lock_guard<std::mutex> lock(historyMutex);
-        history.push_back({role, content});
-        scrollToBottom = true;
-    }
+// A message split into prose and highlighted code blocks. Prose parts are
+// ranges of the message content, which cannot change while the layout
+// lives; code lines are ranges of the block's trimmed copy.
+struct MessageLayout {
+    struct CodeLine {
+        int begin = 0;
+        int end = 0;
+        std::vector<Highlight> highlights; // sorted, non-overlapping, line-relative
+    };
+    struct Code {
+        std::string language;
+        std::string code;
+        std::vector<CodeLine> lines;
+        int numLines = 0;
+    };
+    struct Part {
+        size_t begin = 0;
+        size_t end = 0;
+        int code = -1; // index into codes, or -1 for prose
+    };
+    std::vector<Part> parts;
+    std::vector<Code> codes;
 };
 
+// One in-flight chat request. The UI keeps a shared_ptr to the active one so
+// the Stop button can flag it; the network side polls IsCancelled(). Hedged
+// attempts get a child handle so the losing one can be cancelled on its own.
+struct RequestHandle {
+    std::atomic<bool> cancelled{false};
+    std::shared_ptr<RequestHandle> parent;
+    // Guarded by historyMutex: the message the reply goes under, and the
+    // streamed reply itself once its first text arrives.
+    MessageNode* anchor = nullptr;
+    MessageNode* reply = nullptr;
+    bool bypassCache = false;
 #ifdef _WEB_BUILD
-// Global context pointer for web callbacks (required by Emscripten's C API)
-static AppContext* g_webContext = nullptr;
+    emscripten_fetch_t* fetch = nullptr;
+    int routeIndex = -1;
+    double startMs = 0.0;
+#else
+    static inline std::atomic<std::uint32_t> nextId{1};
+    std::uint32_t id = nextId++; // names the request in the flight recorder
+    bool warmConnection = false; // sent on a pooled or pre-warmed connection
+    // Every phase ends by then at the latest, on top of its own timeout.
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // HTTP bytes of this request's attempts, counted up the parent chain.
+    std::atomic<std::uint64_t> bytesSent{0};
+    std::atomic<std::uint64_t> bytesReceived{0};
+    // Heap allocations made on the attempt threads, and time spent building
+    // the JSON body and parsing replies, counted the same way.
+    std::atomic<std::uint64_t> heapAllocations{0};
+    std::atomic<std::int64_t> jsonMicros{0};
+
+    void AddBytes(std::uint64_t sent, std::uint64_t received) {
+        for (RequestHandle* h = this; h; h = h->parent.get()) {
+            h->bytesSent += sent;
+            h->bytesReceived += received;
+        }
+    }
+
+    void AddCost(std::uint64_t allocations, std::int64_t micros) {
+        for (RequestHandle* h = this; h; h = h->parent.get()) {
+            h->heapAllocations += allocations;
+            h->jsonMicros += micros;
+        }
+    }
 #endif
 
-std::vector<CodeBlock> ExtractCodeBlocks(const std::string& markdown) {
-    std::vector<CodeBlock> blocks;
-    
-    std::regex pattern(R"(```(\w+)?\s*\n([\s\S]*?)```)");
-    
-    auto words_begin = std::sregex_iterator(markdown.begin(), markdown.end(), pattern);
-    auto words_end = std::sregex_iterator();
-    
-    for (std::sregex_iterator i = words_begin; i != words_end; ++i) {
-        std::smatch match = *i;
-        CodeBlock block;
-        block.language = match[1].matched ? match[1].str() : "plaintext";
-        block.code = match[2].str();
-        
-        size_t end = block.code.find_last_not_of(" \n\r\t");
-        if (end != std::string::npos) {
-            block.code = block.code.substr(0, end + 1);
+    bool IsCancelled() const { return cancelled || (parent && parent->IsCancelled()); }
+};
+
+// Per-thread shards of state that only its own thread writes and others
+// read. A thread takes a shard on first use, so writing never locks. When
+// the thread exits its shard goes back to a free list, contents kept, so
+// short-lived request threads don't grow the list. That happens after
+// everything the thread's function owned is gone, so instances are
+// function-local statics that outlive every thread using them.
+template <class Shard>
+struct ThreadShards {
+    std::mutex mutex; // guards shards and spare, not the shards' contents
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::vector<Shard*> spare;
+
+    Shard& Local() {
+        struct Slot {
+            ThreadShards* owner = nullptr;
+            Shard* shard = nullptr;
+            ~Slot() {
+                if (owner)
+                    owner->Return(shard);
+            }
+        };
+        thread_local Slot slot;
+        if (slot.owner != this) {
+            if (slot.owner)
+                slot.owner->Return(slot.shard);
+            slot.owner = this;
+            slot.shard = Take();
         }
-        
-        blocks.push_back(block);
+        return *slot.shard;
     }
-    
-    return blocks;
-}
 
-std::vector<HighlightRule> GetRulesForLanguage(const std::string& lang) {
-    std::vector<HighlightRule> rules;
-    
-    if (lang == "cpp" || lang == "c" || lang == "c++" || lang == "cc" || lang == "cxx") {
-        rules.push_back({
-            std::regex(R"(\b(alignas|alignof|and|and_eq|asm|auto|bitand|bitor|bool|break|case|catch|char|char8_t|char16_t|char32_t|class|compl|concept|const|consteval|constexpr|constinit|const_cast|continue|co_await|co_return|co_yield|decltype|default|delete|do|double|dynamic_cast|else|enum|explicit|export|extern|false|float|for|friend|goto|if|inline|int|long|mutable|namespace|new|noexcept|not|not_eq|nullptr|operator|or|or_eq|private|protected|public|register|reinterpret_cast|requires|return|short|signed|sizeof|static|static_assert|static_cast|struct|switch|template|this|thread_local|throw|true|try|typedef|typeid|typename|union|unsigned|using|virtual|void|volatile|wchar_t|while|xor|xor_eq)\b)"),
-            ImVec4(0.86f, 0.47f, 0.86f, 1.0f)
-        });
-        rules.push_back({
-            std::regex(R"(^\s*#\s*\w+)"),
-            ImVec4(0.7f, 0.7f, 0.4f, 1.0f)
-        });
-        rules.push_back({
-            std::regex(R"("(?:[^"\\]|\\.)*")"),
-            ImVec4(0.9f, 0.7f, 0.4f, 1.0f)
-        });
-        rules.push_back({
-            std::regex(R"(//[^\n]*)"),
-            ImVec4(0.5f, 0.5f, 0.5f, 1.0f)
-        });
-        rules.push_back({
-            std::regex(R"(\b\d+\.?\d*f?\b)"),
-            ImVec4(0.6f, 0.85f, 0.6f, 1.0f)
-        });
-        rules.push_back({
-            std::regex(R"(\b\w+(?=\s*\())"),
-            ImVec4(0.8f, 0.8f, 0.5f, 1.0f)
-        });
-    } 
-    else if (lang == "python" || lang == "py") {
-        rules.push_back({
-            std::regex(R"(\b(False|None|True|and|as|assert|async|await|break|class|continue|def|del|elif|else|except|finally|for|from|global|if|import|in|is|lambda|nonlocal|not|or|pass|raise|return|try|while|with|yield)\b)"),
-            ImVec4(0.86f, 0.47f, 0.86f, 1.0f)
-        });
-        rules.push_back({
-            std::regex(R"((?:"(?:[^"\\]|\\.)*"|'(?:[^'\\]|\\.)*'))"),
-            ImVec4(0.9f, 0.7f, 0.4f, 1.0f)
-        });
-        rules.push_back({
-            std::regex(R"(#[^\n]*)"),
-            ImVec4(0.5f, 0.5f, 0.5f, 1.0f)
-        });
-        rules.push_back({
-            std::regex(R"(\b\d+\.?\d*\b)"),
-            ImVec4(0.6f, 0.85f, 0.6f, 1.0f)
-        });
-        rules.push_back({
-            std::regex(R"((?<=def\s)\w+)"),
-            ImVec4(0.8f, 0.8f, 0.5f, 1.0f)
-        });
+    Shard* Take() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!spare.empty()) {
+            Shard* shard = spare.back();
+            spare.pop_back();
+            return shard;
+        }
+        shards.push_back(std::make_unique<Shard>());
+        return shards.back().get();
     }
-    else if (lang == "javascript" || lang == "js" || lang == "typescript" || lang == "ts") {
-        rules.push_back({
-            std::regex(R"(\b(async|await|break|case|catch|class|const|continue|debugger|default|delete|do|else|enum|export|extends|false|finally|for|function|if|import|in|instanceof|let|new|null|return|super|switch|this|throw|true|try|typeof|var|void|while|with|yield)\b)"),
-            ImVec4(0.86f, 0.47f, 0.86f, 1.0f)
-        });
-        rules.push_back({
-            std::regex(R"((?:"(?:[^"\\]|\\.)*"|'(?:[^'\\]|\\.)*'|`(?:[^`\\]|\\.)*`))"),
-            ImVec4(0.9f, 0.7f, 0.4f, 1.0f)
-        });
-        rules.push_back({
-            std::regex(R"(//[^\n]*)"),
-            ImVec4(0.5f, 0.5f, 0.5f, 1.0f)
-        });
-        rules.push_back({
-            std::regex(R"(\b\d+\.?\d*\b)"),
-            ImVec4(0.6f, 0.85f, 0.6f, 1.0f)
-        });
+
+    void Return(Shard* shard) {
+        std::lock_guard<std::mutex> lock(mutex);
+        spare.push_back(shard);
     }
-    else if (lang == "java") {
-        rules.push_back({
-            std::regex(R"(\b(abstract|assert|boolean|break|byte|case|catch|char|class|const|continue|default|do|double|else|enum|extends|final|finally|float|for|goto|if|implements|import|instanceof|int|interface|long|native|new|package|private|protected|public|return|short|static|strictfp|super|switch|synchronized|this|throw|throws|transient|try|void|volatile|while)\b)"),
-            ImVec4(0.86f, 0.47f, 0.86f, 1.0f)
-        });
-        rules.push_back({
-            std::regex(R"("(?:[^"\\]|\\.)*")"),
-            ImVec4(0.9f, 0.7f, 0.4f, 1.0f)
-        });
-        rules.push_back({
-            std::regex(R"(//[^\n]*)"),
-            ImVec4(0.5f, 0.5f, 0.5f, 1.0f)
-        });
-        rules.push_back({
-            std::regex(R"(\b\d+\.?\d*[fFdDlL]?\b)"),
-            ImVec4(0.6f, 0.85f, 0.6f, 1.0f)
-        });
+
+    // Shards are visited in creation order, which never changes.
+    template <class F>
+    void ForEach(F&& f) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& shard : shards)
+            f(*shard);
     }
-    else if (lang == "rust" || lang == "rs") {
+};
+
+struct TraceSlot {
+    std::atomic<const char*> name{nullptr};
+    std::atomic<const char*> category{nullptr};
+    std::atomic<std::int64_t> startUs{0};
+    std::atomic<std::int64_t> durationUs{0};
+};
+
+// One thread's most recent spans. The writer bumps `begun` before touching
+// a slot and `head` after, so a reader can tell which slots it copied may
+// have been overwritten meanwhile.
+struct TraceBuffer {
+    static constexpr std::uint64_t kCapacity = 1 << 15;
+    std::unique_ptr<TraceSlot[]> slots{new TraceSlot[kCapacity]};
+    std::atomic<std::uint64_t> begun{0};
+    std::atomic<std::uint64_t> head{0};
+    std::atomic<const char*> threadName{"worker"};
+};
+
+// Opt-in span recorder writing Chrome trace-event JSON (chrome://tracing,
+// ui.perfetto.dev). Span names are string literals and go into per-thread
+// ring buffers, so recording costs two clock reads and a few relaxed
+// stores; nothing is formatted until Save().
+struct Tracer {
+    std::atomic<bool> enabled{false};
+    std::string path = "trace.json";
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    ThreadShards<TraceBuffer> buffers;
+
+    std::int64_t Micros(std::chrono::steady_clock::time_point t) const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(t - epoch).count();
+    }
+
+    void Record(const char* name, const char* category, std::chrono::steady_clock::time_point start,
+                std::chrono::steady_clock::time_point end) {
+        TraceBuffer& buffer = buffers.Local();
+        std::uint64_t h = buffer.head.load(std::memory_order_relaxed);
+        buffer.begun.store(h + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        TraceSlot& slot = buffer.slots[h % TraceBuffer::kCapacity];
+        slot.name.store(name, std::memory_order_relaxed);
+        slot.category.store(category, std::memory_order_relaxed);
+        slot.startUs.store(Micros(start), std::memory_order_relaxed);
+        slot.durationUs.store(Micros(end) - Micros(start), std::memory_order_relaxed);
+        buffer.head.store(h + 1, std::memory_order_release);
+    }
+
+    void NameThread(const char* name) {
+        if (enabled)
+            buffers.Local().threadName = name;
+    }
+
+    // Writes every buffered span to `path`. Safe while other threads keep
+    // recording. Returns false if the file could not be written.
+    bool Save() {
+        std::ofstream out(path, std::ios::trunc);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        int tid = 0;
+        buffers.ForEach([&](TraceBuffer& buffer) {
+            tid++;
+            out << (tid > 1 ? ",\n" : "") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+                << tid << ",\"args\":{\"name\":\"" << buffer.threadName.load() << "\"}}";
+            std::uint64_t end = buffer.head.load(std::memory_order_acquire);
+            std::uint64_t begin = end > TraceBuffer::kCapacity ? end - TraceBuffer::kCapacity : 0;
+            struct Event {
+                const char* name;
+                const char* category;
+                std::int64_t startUs;
+                std::int64_t durationUs;
+            };
+            std::vector<Event> events;
+            events.reserve(end - begin);
+            for (std::uint64_t i = begin; i < end; i++) {
+                const TraceSlot& slot = buffer.slots[i % TraceBuffer::kCapacity];
+                events.push_back({slot.name.load(std::memory_order_relaxed),
+                                  slot.category.load(std::memory_order_relaxed),
+                                  slot.startUs.load(std::memory_order_relaxed),
+                                  slot.durationUs.load(std::memory_order_relaxed)});
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            std::uint64_t begun = buffer.begun.load(std::memory_order_relaxed);
+            std::uint64_t valid = begun > TraceBuffer::kCapacity ? begun - TraceBuffer::kCapacity : 0;
+            for (std::uint64_t i = std::max(begin, valid); i < end; i++) {
+                const Event& e = events[i - begin];
+                out << ",\n{\"name\":\"" << e.name << "\",\"cat\":\"" << e.category
+                    << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid << ",\"ts\":" << e.startUs
+                    << ",\"dur\":" << e.durationUs << "}";
+            }
+        });
+        out << "\n]}\n";
+        return (bool)out;
+    }
+};
+
+Tracer& GetTracer() {
+    static Tracer tracer;
+    return tracer;
+}
+
+// Records the enclosing scope as a span while tracing is on.
+struct TraceSpan {
+    const char* name;
+    const char* category;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+
+    TraceSpan(const char* n, const char* c)
+        : name(n), category(c), active(GetTracer().enabled.load(std::memory_order_relaxed)) {
+        if (active)
+            start = std::chrono::steady_clock::now();
+    }
+    ~TraceSpan() {
+        if (active)
+            GetTracer().Record(name, category, start, std::chrono::steady_clock::now());
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+// Locks `mutex`, recording a span named `name` if it had to wait.
+std::unique_lock<std::mutex> TraceLock(std::mutex& mutex, const char* name) {
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        TraceSpan span(name, "lock");
+        lock.lock();
+    }
+    return lock;
+}
+
+// A thread's reusable memory for parsing replies. Parse() builds the value
+// in a monotonic resource over `buffer`, spilling to the heap only for
+// documents larger than that, and starts over on the next call: the value
+// it returns must be gone by then.
+struct JsonScratch {
+    unsigned char buffer[64 * 1024];
+    unsigned char parserStack[4 * 1024];
+    json::monotonic_resource resource{buffer, sizeof(buffer)};
+    json::parser parser{json::storage_ptr(), json::parse_options(), parserStack, sizeof(parserStack)};
+
+    json::value Parse(std::string_view text) {
+        MemTagScope tag(MemTag::Json);
+        resource.release();
+        parser.reset(json::storage_ptr(&resource));
+        parser.write(json::string_view(text.data(), text.size()));
+        return parser.release();
+    }
+};
+
+JsonScratch& LocalJsonScratch() {
+    static ThreadShards<JsonScratch> scratch;
+    return scratch.Local();
+}
+
+// One upstream model/provider the client can send chat requests to.
+struct Route {
+    std::string name;
+    std::string model;
+    std::string host = "openrouter.ai";
+    std::string port = "443";
+    std::string target = "/api/v1/chat/completions";
+    bool gzipRequests = false; // endpoint accepts gzip-encoded request bodies
+    bool cacheControl = false; // provider honours cache_control prompt breakpoints
+    bool tls = true; // false for plain HTTP, e.g. a local gateway
+};
+
+// Token counts from a reply's `usage` block; -1 when the provider did not
+// report them.
+struct Usage {
+    int promptTokens = -1;
+    int completionTokens = -1;
+    int cachedTokens = -1; // prompt tokens served from the provider's prompt cache
+};
+
+Usage ParseUsage(const json::value& usage) {
+    Usage u;
+    if (const json::object* obj = usage.if_object()) {
+        if (auto* v = obj->if_contains("prompt_tokens"))
+            u.promptTokens = v->to_number<int>();
+        if (auto* v = obj->if_contains("completion_tokens"))
+            u.completionTokens = v->to_number<int>();
+        if (auto* details = obj->if_contains("prompt_tokens_details"); details && details->is_object()) {
+            if (auto* v = details->as_object().if_contains("cached_tokens"); v && v->is_number())
+                u.cachedTokens = v->to_number<int>();
+        } else if (auto* v = obj->if_contains("cache_read_input_tokens"); v && v->is_number()) {
+            u.cachedTokens = v->to_number<int>();
+        }
+    }
+    return u;
+}
+
+// Exponentially weighted moving averages, fed by real traffic.
+struct RouteStats {
+    double ttftMs = 0.0;
+    double tokensPerSec = 0.0;
+    double errorRate = 0.0;
+    int samples = 0;
+    std::chrono::steady_clock::time_point lastSample;
+};
+
+constexpr double kRouteEwmaAlpha = 0.2;
+constexpr double kUnhealthyErrorRate = 0.5;
+// Reply length assumed when turning TTFT and tokens/s into one expected time.
+constexpr double kTypicalReplyTokens = 200.0;
+
+// Picks the healthy route with the lowest expected reply time. A fraction of
+// requests (`exploration`) instead go to the route sampled longest ago,
+// unhealthy ones included, so stale statistics get refreshed and a route
+// that recovered gets noticed.
+struct Router {
+    std::mutex mutex;
+    std::vector<Route> routes;
+    std::vector<RouteStats> stats;
+    int pinned = -1; // -1 picks automatically
+    double exploration = 0.1;
+    // Embeddings API for recall; unset uses the local hashed stand-in.
+    std::optional<Route> embeddings;
+    std::mt19937 rng{std::random_device{}()};
+
+    Router() { SetRoutes({{"Mistral 7B", "mistralai/mistral-7b-instruct:free"}}); }
+
+    void SetRoutes(std::vector<Route> r) {
+        std::lock_guard<std::mutex> lock(mutex);
+        routes = std::move(r);
+        stats.assign(routes.size(), RouteStats());
+        pinned = -1;
+    }
+
+    static double ExpectedMs(const RouteStats& s) {
+        double streamMs = s.tokensPerSec > 0.0 ? kTypicalReplyTokens * 1000.0 / s.tokensPerSec : 0.0;
+        return (s.ttftMs + streamMs) / (1.0 - std::min(s.errorRate, 0.9));
+    }
+
+    // Returns a route index other than `exclude` when there is one.
+    int Pick(int exclude = -1) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pinned >= 0 && pinned < (int)routes.size())
+            return pinned;
+
+        std::vector<int> candidates;
+        for (int i = 0; i < (int)routes.size(); i++)
+            if (i != exclude)
+                candidates.push_back(i);
+        if (candidates.empty())
+            return exclude;
+
+        for (int i : candidates)
+            if (stats[i].samples == 0)
+                return i;
+
+        if (std::uniform_real_distribution<double>(0.0, 1.0)(rng) < exploration) {
+            return *std::min_element(candidates.begin(), candidates.end(), [&](int a, int b) {
+                return stats[a].lastSample < stats[b].lastSample;
+            });
+        }
+
+        int best = -1;
+        for (int i : candidates) {
+            if (stats[i].errorRate >= kUnhealthyErrorRate)
+                continue;
+            if (best < 0 || ExpectedMs(stats[i]) < ExpectedMs(stats[best]))
+                best = i;
+        }
+        if (best < 0) {
+            best = *std::min_element(candidates.begin(), candidates.end(), [&](int a, int b) {
+                return stats[a].errorRate < stats[b].errorRate;
+            });
+        }
+        return best;
+    }
+
+    Route Get(int index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return routes[index];
+    }
+
+    void RecordSuccess(int index, double ttftMs, double tokensPerSec) {
+        std::lock_guard<std::mutex> lock(mutex);
+        RouteStats& s = stats[index];
+        if (s.samples == 0) {
+            s.ttftMs = ttftMs;
+            s.tokensPerSec = tokensPerSec;
+        } else {
+            s.ttftMs += kRouteEwmaAlpha * (ttftMs - s.ttftMs);
+            if (tokensPerSec > 0.0)
+                s.tokensPerSec += kRouteEwmaAlpha * (tokensPerSec - s.tokensPerSec);
+        }
+        s.errorRate -= kRouteEwmaAlpha * s.errorRate;
+        s.samples++;
+        s.lastSample = std::chrono::steady_clock::now();
+    }
+
+    void RecordFailure(int index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        RouteStats& s = stats[index];
+        s.errorRate = s.samples == 0 ? 1.0 : s.errorRate + kRouteEwmaAlpha * (1.0 - s.errorRate);
+        s.samples++;
+        s.lastSample = std::chrono::steady_clock::now();
+    }
+};
+
+// Reads candidate routes from a JSON file:
+//   {"exploration": 0.1, "routes": [{"name": "...", "model": "...",
+//     "host": "openrouter.ai", "port": "443", "path": "/api/v1/chat/completions"}]}
+// Only "model" is required. Returns an error message, or "" on success; a
+// missing file is not an error and keeps the built-in route.
+std::string LoadRoutes(Router& router, const std::string& path) {
+    std::ifstream file(path);
+    if (!file)
+        return "";
+    std::stringstream ss;
+    ss << file.rdbuf();
+
+    try {
+        json::value jv = json::parse(ss.str());
+        auto parseRoute = [](const json::object& obj, Route route) {
+            route.model = json::value_to<std::string>(obj.at("model"));
+            route.name = route.model;
+            if (auto* v = obj.if_contains("name"))
+                route.name = json::value_to<std::string>(*v);
+            if (auto* v = obj.if_contains("host"))
+                route.host = json::value_to<std::string>(*v);
+            if (auto* v = obj.if_contains("port"))
+                route.port = json::value_to<std::string>(*v);
+            if (auto* v = obj.if_contains("path"))
+                route.target = json::value_to<std::string>(*v);
+            if (auto* v = obj.if_contains("gzip_requests"))
+                route.gzipRequests = v->as_bool();
+            if (auto* v = obj.if_contains("cache_control"))
+                route.cacheControl = v->as_bool();
+            if (auto* v = obj.if_contains("tls"))
+                route.tls = v->as_bool();
+            return route;
+        };
+        std::vector<Route> routes;
+        for (const auto& item : jv.at("routes").as_array())
+            routes.push_back(parseRoute(item.as_object(), Route()));
+        if (routes.empty())
+            return path + ": no routes";
+        router.SetRoutes(std::move(routes));
+        if (auto* v = jv.as_object().if_contains("exploration"))
+            router.exploration = v->to_number<double>();
+        if (auto* v = jv.as_object().if_contains("embeddings")) {
+            Route route;
+            route.target = "/api/v1/embeddings";
+            route = parseRoute(v->as_object(), route);
+            std::lock_guard<std::mutex> lock(router.mutex);
+            router.embeddings = route;
+        }
+    } catch (std::exception const &e) {
+        return path + ": " + e.what();
+    }
+    return "";
+}
+
+// The API key field may hold several keys separated by commas or spaces.
+std::vector<std::string> SplitApiKeys(const std::string& keys) {
+    std::vector<std::string> list;
+    std::string key;
+    std::istringstream in(keys);
+    while (std::getline(in, key, ',')) {
+        std::istringstream words(key);
+        std::string word;
+        while (words >> word)
+            list.push_back(word);
+    }
+    return list;
+}
+
+#ifndef _WEB_BUILD
+// How long a request thread blocks in the io_context before re-checking
+// its cancel flag. Well below one frame so Stop lands immediately.
+constexpr auto kCancelPollInterval = std::chrono::milliseconds(5);
+constexpr auto kPoolIdleTimeout = std::chrono::seconds(30);
+constexpr size_t kPoolMaxIdle = 4;
+// Keystrokes come in bursts; don't start a new pre-warm more often than this.
+constexpr auto kPrewarmInterval = std::chrono::seconds(2);
+// Requests carry the history from a start point that only jumps forward
+// once more than kContextMaxMessages are in play, back to the last
+// kContextMinMessages. In between, each request's prefix is byte-identical
+// to the previous one's, which is what provider prompt caches key on.
+constexpr size_t kContextMinMessages = 4;
+constexpr size_t kContextMaxMessages = 12;
+// Asio doesn't expose DNS record TTLs, so cached lookups live this long.
+constexpr auto kDnsTtl = std::chrono::seconds(60);
+// Past its TTL an address is still used, while it is looked up again in
+// the background, for this long.
+constexpr auto kDnsStaleGrace = std::chrono::minutes(10);
+// Refill window assumed when a provider reports a limit but no reset time.
+constexpr auto kRateLimitWindow = std::chrono::seconds(60);
+// How often the metrics textfile is rewritten.
+constexpr auto kMetricsFileInterval = std::chrono::seconds(15);
+// New TLS tickets are written to disk at most this often, and at exit.
+constexpr auto kTlsSessionSaveInterval = std::chrono::seconds(30);
+// Larger entries in tls_sessions.bin are taken as a damaged file.
+constexpr size_t kMaxTlsSessionBytes = 64 * 1024;
+
+// Per-phase deadlines. Read idle is the longest gap allowed between two
+// body chunks once the reply has started.
+struct RequestTimeouts {
+    std::chrono::milliseconds resolve{5000};
+    std::chrono::milliseconds connect{5000};
+    std::chrono::milliseconds handshake{5000};
+    std::chrono::milliseconds write{10000};
+    std::chrono::milliseconds firstByte{30000};
+    std::chrono::milliseconds readIdle{30000};
+    // Stagger between parallel connection attempts (RFC 8305 suggests 250 ms).
+    std::chrono::milliseconds connectAttemptDelay{250};
+};
+
+struct RetryPolicy {
+    int maxAttempts = 3;
+    std::chrono::milliseconds baseDelay{500};
+    std::chrono::milliseconds maxDelay{8000};
+};
+
+// Until enough TTFT samples exist, hedge after this long.
+constexpr auto kDefaultHedgeDelay = std::chrono::milliseconds(3000);
+constexpr auto kMinHedgeDelay = std::chrono::milliseconds(250);
+constexpr size_t kMinHedgeSamples = 10;
+
+// Reorders `values`.
+template <class Values>
+double Percentile(Values& values, double p) {
+    if (values.empty())
+        return 0.0;
+    size_t idx = std::min(values.size() - 1, (size_t)(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + idx, values.end());
+    return values[idx];
+}
+
+// Sliding window of recent time-to-first-token samples, in milliseconds.
+struct LatencyTracker {
+    std::mutex mutex;
+    std::vector<double> samples;
+    size_t next = 0;
+    static constexpr size_t kWindow = 128;
+
+    void Add(double ms) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (samples.size() < kWindow) {
+            samples.push_back(ms);
+        } else {
+            samples[next] = ms;
+            next = (next + 1) % kWindow;
+        }
+    }
+
+    size_t Count() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return samples.size();
+    }
+
+    double Percentile(double p, std::pmr::memory_resource* scratch = std::pmr::get_default_resource()) {
+        std::pmr::vector<double> copy(scratch);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            copy.assign(samples.begin(), samples.end());
+        }
+        return ::Percentile(copy, p);
+    }
+};
+
+// How well the provider's prompt cache works for us, from the cached-token
+// counts in `usage`. TTFT is split by whether any prompt tokens were hits.
+struct PromptCacheStats {
+    std::atomic<long long> promptTokens{0};
+    std::atomic<long long> cachedTokens{0};
+    LatencyTracker ttftHit;
+    LatencyTracker ttftMiss;
+
+    void Record(const Usage& usage, double ttftMs) {
+        if (usage.promptTokens <= 0 || usage.cachedTokens < 0)
+            return;
+        promptTokens += usage.promptTokens;
+        cachedTokens += usage.cachedTokens;
+        (usage.cachedTokens > 0 ? ttftHit : ttftMiss).Add(ttftMs);
+    }
+
+    double HitRate() const {
+        long long prompt = promptTokens;
+        return prompt > 0 ? (double)cachedTokens / prompt : 0.0;
+    }
+};
+
+
+// Upper bounds, in seconds, of the metrics histogram buckets; +Inf is implied.
+constexpr std::array<double, 9> kLatencyBuckets = {0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60};
+constexpr std::array<double, 8> kTtftBuckets = {0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+constexpr std::array<double, 8> kFrameBuckets = {0.001, 0.0025, 0.005, 0.01, 0.016, 0.033, 0.05, 0.1};
+// Routes from this index on share the last per-route metrics slot.
+constexpr size_t kMetricRoutes = 16;
+const char* const kMetricStatuses[] = {"ok", "error", "cancelled"};
+
+template <size_t N>
+struct HistogramShard {
+    std::array<std::atomic<std::uint64_t>, N + 1> counts{};
+    std::atomic<std::uint64_t> sumMicros{0};
+
+    void Observe(const std::array<double, N>& bounds, double seconds) {
+        size_t i = std::lower_bound(bounds.begin(), bounds.end(), seconds) - bounds.begin();
+        counts[i].fetch_add(1, std::memory_order_relaxed);
+        sumMicros.fetch_add((std::uint64_t)(std::max(seconds, 0.0) * 1e6), std::memory_order_relaxed);
+    }
+};
+
+// One thread's share of the metrics. Only that thread writes to it, so an
+// update is an uncontended relaxed add. Gauges are kept as deltas and only
+// mean something summed over all shards.
+struct MetricsShard {
+    HistogramShard<kLatencyBuckets.size()> latency[kMetricRoutes];
+    HistogramShard<kTtftBuckets.size()> ttft[kMetricRoutes];
+    std::atomic<std::uint64_t> requests[kMetricRoutes][3]; // by kMetricStatuses
+    std::atomic<std::uint64_t> retries{0};
+    std::atomic<std::uint64_t> cacheHits{0};
+    std::atomic<std::uint64_t> cacheMisses{0};
+    std::atomic<std::uint64_t> connectionsOpened{0};
+    std::atomic<std::int64_t> inFlight{0};
+    HistogramShard<kFrameBuckets.size()> frame;
+};
+
+// Counters for the metrics exporter. Instrumented paths update their own
+// thread's shard through Local() without locking; a scrape sums the shards.
+struct Metrics {
+    ThreadShards<MetricsShard> shards;
+    std::atomic<std::uint64_t> historyBytes{0}; // sampled by the UI thread
+
+    MetricsShard& Local() { return shards.Local(); }
+};
+
+// Process-wide, like the tracer, for the lifetime rule of ThreadShards.
+Metrics& GetMetrics() {
+    static Metrics metrics;
+    return metrics;
+}
+
+size_t MetricRoute(int route) {
+    return std::min((size_t)route, kMetricRoutes - 1);
+}
+
+// One finished request as the usage ledger records it.
+struct LedgerEntry {
+    std::int64_t timeMs = 0; // Unix time the request started
+    std::string route;
+    std::string status; // ok, error or cancelled
+    int promptTokens = -1;
+    int completionTokens = -1;
+    int cachedTokens = -1;
+    float ttftMs = -1.0f; // from the start of the request, retries included
+    float totalMs = 0.0f;
+    float tokensPerSec = 0.0f;
+    std::uint64_t bytesSent = 0;
+    std::uint64_t bytesReceived = 0;
+    int retries = 0;
+    std::uint64_t heapAllocations = 0; // on the attempt threads
+    float jsonMs = 0.0f;               // building the body and parsing replies
+};
+
+// Recent requests in memory, and every request as one tab-separated line
+// appended to `path`.
+struct UsageLedger {
+    static constexpr size_t kCapacity = 1024;
+    std::mutex mutex;
+    std::vector<LedgerEntry> ring;
+    size_t next = 0;
+    std::filesystem::path path = "usage.log";
+    std::ofstream log;
+
+    void Add(const LedgerEntry& e) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ring.size() < kCapacity) {
+            ring.push_back(e);
+        } else {
+            ring[next] = e;
+            next = (next + 1) % kCapacity;
+        }
+        if (!log.is_open())
+            log.open(path, std::ios::app);
+        log << e.timeMs << '\t' << e.route << '\t' << e.status << '\t' << e.promptTokens << '\t'
+            << e.completionTokens << '\t' << e.cachedTokens << '\t' << (int)e.ttftMs << '\t'
+            << (int)e.totalMs << '\t' << e.tokensPerSec << '\t' << e.bytesSent << '\t'
+            << e.bytesReceived << '\t' << e.retries << '\t' << e.heapAllocations << '\t'
+            << e.jsonMs << '\n';
+        log.flush();
+    }
+
+    std::vector<LedgerEntry> Snapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return ring;
+    }
+
+    template <class F>
+    void ForEach(F&& f) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const LedgerEntry& e : ring)
+            f(e);
+    }
+};
+
+enum class FlightEvent : std::uint16_t {
+    RequestStart = 1, // value: body bytes; data: model, endpoint
+    ResponseHead,     // value: HTTP status; data: status line and headers
+    BodyHead,         // data: first bytes of the decoded body
+    FirstToken,       // value: ms since the attempt started
+    HttpError,        // value: HTTP status; data: error body
+    StreamError,      // data: error event sent mid-stream
+    ParseError,       // data: parser message, then the offending payload
+    TransportError,   // data: phase and error
+    Backoff,          // value: ms until the next attempt
+    RequestEnd,       // value: total ms; data: status and route
+};
+
+const char* FlightEventName(std::uint16_t type) {
+    static const char* const names[] = {"?", "request-start", "response-head", "body-head",
+                                        "first-token", "http-error", "stream-error", "parse-error",
+                                        "transport-error", "backoff", "request-end"};
+    return type < sizeof(names) / sizeof(names[0]) ? names[type] : "?";
+}
+
+// A fixed-size record, so writers never wait on each other: each claims a
+// slot with one atomic add and copies at most kDataSize bytes. `begin` and
+// `end` hold the same sequence number once a record is complete; a dump
+// taken mid-write shows them differing.
+struct FlightRecord {
+    static constexpr size_t kDataSize = 216;
+    std::uint64_t begin;
+    std::int64_t timeUs; // Unix time
+    std::uint32_t requestId;
+    std::uint32_t parentId;
+    std::uint16_t type;
+    std::uint16_t size;
+    std::int32_t value;
+    char data[kDataSize];
+    std::uint64_t end;
+};
+static_assert(sizeof(FlightRecord) == 256, "flight records are dumped as raw slots");
+
+struct FlightHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t slots;
+    std::uint32_t slotSize;
+    std::uint32_t reserved;
+    std::uint64_t next;
+};
+
+// Always-on ring of the last kSlots request events. Dump() only uses
+// open/write/close, so it also runs from the crash signal handlers; the
+// file is raw slots, turned into text by --decode-flight.
+struct FlightRecorder {
+    static constexpr std::uint32_t kSlots = 4096;
+    std::atomic<std::uint64_t> next{0};
+    FlightRecord records[kSlots];
+    char path[256] = "flight.bin";
+
+    void Record(FlightEvent type, std::uint32_t requestId, std::uint32_t parentId,
+                std::int32_t value, std::string_view data) {
+        std::uint64_t seq = next.fetch_add(1, std::memory_order_relaxed) + 1;
+        FlightRecord& r = records[seq % kSlots];
+        r.end = 0;
+        r.begin = seq;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        r.timeUs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        r.requestId = requestId;
+        r.parentId = parentId;
+        r.type = (std::uint16_t)type;
+        r.value = value;
+        r.size = (std::uint16_t)std::min(data.size(), FlightRecord::kDataSize);
+        memcpy(r.data, data.data(), r.size);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        r.end = seq;
+    }
+
+    bool Dump() const {
+        int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+            return false;
+        FlightHeader header = {{'S', 'B', 'F', 'L', 'I', 'G', 'H', 'T'}, 1, kSlots,
+                               sizeof(FlightRecord), 0, next.load(std::memory_order_relaxed)};
+        bool ok = WriteAll(fd, &header, sizeof(header)) && WriteAll(fd, records, sizeof(records));
+        ::close(fd);
+        return ok;
+    }
+
+    static bool WriteAll(int fd, const void* data, size_t size) {
+        const char* p = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t n = ::write(fd, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= (size_t)n;
+        }
+        return true;
+    }
+};
+
+FlightRecorder& GetFlightRecorder() {
+    static FlightRecorder recorder;
+    return recorder;
+}
+
+void RecordFlight(const RequestHandle& req, FlightEvent type, std::int32_t value = 0,
+                  std::string_view data = {}) {
+    GetFlightRecorder().Record(type, req.id, req.parent ? req.parent->id : 0, value, data);
+}
+
+// Dumps the recorder on crashes (then lets the signal kill the process as
+// before) and on SIGUSR1 (then carries on).
+void InstallFlightDumpHandlers() {
+    GetFlightRecorder();
+    struct sigaction crash = {};
+    crash.sa_handler = [](int sig) {
+        GetFlightRecorder().Dump();
+        ::raise(sig);
+    };
+    crash.sa_flags = SA_RESETHAND;
+    for (int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT})
+        ::sigaction(sig, &crash, nullptr);
+    struct sigaction dump = {};
+    dump.sa_handler = [](int) { GetFlightRecorder().Dump(); };
+    dump.sa_flags = SA_RESTART;
+    ::sigaction(SIGUSR1, &dump, nullptr);
+}
+
+// Prints a dump written by FlightRecorder::Dump, oldest record first.
+bool DecodeFlight(const char* path, std::ostream& out) {
+    std::ifstream in(path, std::ios::binary);
+    FlightHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        memcmp(header.magic, "SBFLIGHT", 8) != 0 || header.version != 1 ||
+        header.slotSize != sizeof(FlightRecord)) {
+        std::cerr << path << ": not a flight recorder dump\n";
+        return false;
+    }
+    std::vector<FlightRecord> records(header.slots);
+    in.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(FlightRecord));
+    records.resize(in.gcount() / sizeof(FlightRecord));
+    size_t torn = 0;
+    records.erase(std::remove_if(records.begin(), records.end(), [&](const FlightRecord& r) {
+        bool incomplete = r.begin != r.end;
+        torn += incomplete;
+        return r.begin == 0 || incomplete || r.size > FlightRecord::kDataSize;
+    }), records.end());
+    std::sort(records.begin(), records.end(),
+              [](const FlightRecord& a, const FlightRecord& b) { return a.begin < b.begin; });
+
+    for (const FlightRecord& r : records) {
+        std::time_t seconds = (std::time_t)(r.timeUs / 1000000);
+        char when[32];
+        std::strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", std::localtime(&seconds));
+        char micros[8];
+        snprintf(micros, sizeof(micros), ".%06d", (int)(r.timeUs % 1000000));
+        out << when << micros << " #" << r.requestId;
+        if (r.parentId)
+            out << "<#" << r.parentId;
+        out << ' ' << FlightEventName(r.type) << ' ' << r.value;
+        if (r.size)
+            out << ' ';
+        for (size_t i = 0; i < r.size; i++) {
+            unsigned char c = (unsigned char)r.data[i];
+            if (c == '\r')
+                out << "\\r";
+            else if (c == '\n')
+                out << "\\n";
+            else if (c == '\\')
+                out << "\\\\";
+            else if (c < 0x20 || c == 0x7f)
+                out << "\\x" << "0123456789abcdef"[c >> 4] << "0123456789abcdef"[c & 15];
+            else
+                out << (char)c;
+        }
+        if (r.size == FlightRecord::kDataSize)
+            out << "...";
+        out << '\n';
+    }
+    if (torn)
+        out << "(" << torn << " record(s) were being written during the dump)\n";
+    return true;
+}
+
+// A TLS connection that owns its io_context. Whichever thread holds the
+// connection drives that io_context, so connections can be handed between
+// request threads through the pool without any cross-thread posting.
+struct Connection {
+    net::io_context ioc;
+    beast::ssl_stream<beast::tcp_stream> stream;
+    beast::flat_buffer buffer;
+    std::string host;
+    std::string port;
+    bool tls = true;
+    std::chrono::steady_clock::time_point lastUsed;
+
+    Connection(ssl::context& sslCtx, std::string h, std::string p)
+        : stream(ioc, sslCtx), host(std::move(h)), port(std::move(p)) {}
+
+    // Calls f with the TLS stream, or for plain connections with the TCP
+    // stream beneath it.
+    template <class F>
+    void Use(F&& f) {
+        if (tls)
+            f(stream);
+        else
+            f(beast::get_lowest_layer(stream));
+    }
+
+    void Close() {
+        beast::error_code ec;
+        beast::get_lowest_layer(stream).socket().shutdown(tcp::socket::shutdown_both, ec);
+        beast::get_lowest_layer(stream).close();
+    }
+};
+
+// Idle keep-alive connections, newest last.
+struct ConnectionPool {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Connection>> idle;
+    std::atomic<size_t> idleCount{0}; // idle.size(), readable without the lock
+    size_t maxIdle = kPoolMaxIdle;
+
+    // Called with mutex held; the caller closes the expired connections
+    // after unlocking.
+    void TakeExpired(std::vector<std::unique_ptr<Connection>>& expired) {
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = idle.begin(); it != idle.end();) {
+            if (now - (*it)->lastUsed > kPoolIdleTimeout) {
+                expired.push_back(std::move(*it));
+                it = idle.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        idleCount = idle.size();
+    }
+
+    // Drops connections that sat idle past kPoolIdleTimeout.
+    void Prune() {
+        std::vector<std::unique_ptr<Connection>> expired;
+        std::lock_guard<std::mutex> lock(mutex);
+        TakeExpired(expired);
+    }
+
+    bool HasIdle(const std::string& host, const std::string& port) {
+        std::vector<std::unique_ptr<Connection>> expired;
+        std::lock_guard<std::mutex> lock(mutex);
+        TakeExpired(expired);
+        for (auto& conn : idle)
+            if (conn->host == host && conn->port == port)
+                return true;
+        return false;
+    }
+
+    std::unique_ptr<Connection> Acquire(const std::string& host, const std::string& port) {
+        std::vector<std::unique_ptr<Connection>> expired;
+        std::unique_ptr<Connection> found;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            TakeExpired(expired);
+            for (auto it = idle.rbegin(); it != idle.rend(); ++it) {
+                if ((*it)->host == host && (*it)->port == port) {
+                    found = std::move(*it);
+                    idle.erase(std::next(it).base());
+                    idleCount = idle.size();
+                    break;
+                }
+            }
+        }
+        return found;
+    }
+
+    void Release(std::unique_ptr<Connection> conn) {
+        conn->lastUsed = std::chrono::steady_clock::now();
+        std::unique_ptr<Connection> evicted;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idle.size() >= maxIdle) {
+            evicted = std::move(idle.front());
+            idle.erase(idle.begin());
+        }
+        idle.push_back(std::move(conn));
+        idleCount = idle.size();
+    }
+};
+
+// A reply as stored in the response cache.
+struct CachedReply {
+    std::string route;
+    std::string text;
+    Usage usage;
+};
+
+// Opt-in, content-addressed reply cache. The key is the SHA-256 of the
+// canonical request: the route's endpoint and model plus the serialized
+// messages, so streamed and non-streamed requests share entries. Each entry
+// is one JSON file in `dir`. The index and the most recently used replies
+// stay in memory, so a hit is a map lookup. File mtimes record recency
+// across restarts, and least recently used files are deleted once the
+// directory grows past maxBytes.
+struct ResponseCache {
+    struct Entry {
+        std::uintmax_t bytes = 0;
+        std::list<std::string>::iterator lru;
+        std::shared_ptr<const CachedReply> reply; // null until loaded
+    };
+
+    std::mutex mutex;
+    std::atomic<bool> enabled{false};
+    std::filesystem::path dir = "cache";
+    std::uintmax_t maxBytes = 64ull << 20;
+    size_t maxLoaded = 256;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru; // most recently used first
+    std::uintmax_t totalBytes = 0;
+    size_t loaded = 0;
+    bool indexed = false;
+
+    // Hashes the endpoint, the model and the messages as a JSON array,
+    // fed in pieces so the conversation is never copied into one string.
+    static std::string Key(const Route& route, const MessageFragments& messages) {
+        std::string head = route.host + route.target + "\n" + route.model + "\n[";
+        EVP_MD_CTX* md_ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(md_ctx, EVP_sha256(), nullptr);
+        EVP_DigestUpdate(md_ctx, head.data(), head.size());
+        for (size_t i = 0; i < messages.size(); i++) {
+            if (i > 0)
+                EVP_DigestUpdate(md_ctx, ",", 1);
+            EVP_DigestUpdate(md_ctx, messages[i]->data(), messages[i]->size());
+        }
+        EVP_DigestUpdate(md_ctx, "]", 1);
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int len = 0;
+        EVP_DigestFinal_ex(md_ctx, md, &len);
+        EVP_MD_CTX_free(md_ctx);
+        static const char* hex = "0123456789abcdef";
+        std::string key;
+        for (unsigned int i = 0; i < len; i++) {
+            key += hex[md[i] >> 4];
+            key += hex[md[i] & 15];
+        }
+        return key;
+    }
+
+    std::filesystem::path PathFor(const std::string& key) const { return dir / (key + ".json"); }
+
+    // Called with mutex held.
+    void Index() {
+        if (indexed)
+            return;
+        indexed = true;
+        std::error_code ec;
+        std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::directory_entry>> files;
+        for (const auto& file : std::filesystem::directory_iterator(dir, ec))
+            if (file.path().extension() == ".json")
+                files.emplace_back(file.last_write_time(ec), file);
+        std::sort(files.begin(), files.end(),
+                  [](const auto& a, const auto& b) { return a.first > b.first; });
+        for (const auto& f : files) {
+            std::string key = f.second.path().stem().string();
+            lru.push_back(key);
+            Entry& e = entries[key];
+            e.bytes = f.second.file_size(ec);
+            e.lru = std::prev(lru.end());
+            totalBytes += e.bytes;
+        }
+    }
+
+    // Called with mutex held. Drops loaded replies beyond maxLoaded and
+    // files beyond maxBytes, least recently used first.
+    void Trim() {
+        for (auto it = lru.rbegin(); loaded > maxLoaded && it != lru.rend(); ++it) {
+            Entry& e = entries[*it];
+            if (e.reply) {
+                e.reply.reset();
+                loaded--;
+            }
+        }
+        while (totalBytes > maxBytes && !lru.empty())
+            Erase(std::string(lru.back()));
+    }
+
+    // Called with mutex held. Forgets the entry and deletes its file.
+    void Erase(const std::string& key) {
+        auto it = entries.find(key);
+        if (it == entries.end())
+            return;
+        totalBytes -= it->second.bytes;
+        if (it->second.reply)
+            loaded--;
+        lru.erase(it->second.lru);
+        entries.erase(it);
+        std::error_code ec;
+        std::filesystem::remove(PathFor(key), ec);
+    }
+
+    std::shared_ptr<const CachedReply> Get(const std::string& key) {
+        std::shared_ptr<const CachedReply> hit = Find(key);
+        // The file's mtime carries the LRU order over to the next Index().
+        // A syscall, so not under the cache-wide lock.
+        if (hit) {
+            std::error_code ec;
+            std::filesystem::last_write_time(PathFor(key), std::filesystem::file_time_type::clock::now(), ec);
+        }
+        return hit;
+    }
+
+    std::shared_ptr<const CachedReply> Find(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Index();
+        auto it = entries.find(key);
+        if (it == entries.end())
+            return nullptr;
+        Entry& e = it->second;
+        lru.splice(lru.begin(), lru, e.lru);
+        if (!e.reply) {
+            std::ifstream file(PathFor(key), std::ios::binary);
+            std::stringstream ss;
+            ss << file.rdbuf();
+            json::error_code jec;
+            json::value jv = json::parse(ss.str(), jec);
+            if (jec || !jv.is_object()) {
+                // Damaged or truncated: don't read it again, or count it.
+                Erase(key);
+                return nullptr;
+            }
+            auto reply = std::make_shared<CachedReply>();
+            const json::object& obj = jv.as_object();
+            if (auto* v = obj.if_contains("route"))
+                reply->route = json::value_to<std::string>(*v);
+            if (auto* v = obj.if_contains("text"))
+                reply->text = json::value_to<std::string>(*v);
+            if (auto* v = obj.if_contains("usage"))
+                reply->usage = ParseUsage(*v);
+            e.reply = reply;
+            loaded++;
+            Trim();
+        }
+        return e.reply;
+    }
+
+    void Put(const std::string& key, CachedReply reply) {
+        json::object obj;
+        obj["route"] = reply.route;
+        obj["text"] = reply.text;
+        // In the provider's own shape, so Get() reads it back with ParseUsage.
+        obj["usage"] = {{"prompt_tokens", reply.usage.promptTokens},
+                        {"completion_tokens", reply.usage.completionTokens},
+                        {"prompt_tokens_details", {{"cached_tokens", reply.usage.cachedTokens}}}};
+        std::string data = json::serialize(obj);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        Index();
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        std::filesystem::path tmp = PathFor(key);
+        tmp += ".tmp";
+        {
+            std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+            file.write(data.data(), data.size());
+            if (!file)
+                return;
+        }
+        std::filesystem::rename(tmp, PathFor(key), ec);
+        if (ec)
+            return;
+
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            totalBytes -= it->second.bytes;
+            if (it->second.reply)
+                loaded--;
+            lru.erase(it->second.lru);
+        }
+        lru.push_front(key);
+        Entry& e = entries[key];
+        e.bytes = data.size();
+        e.lru = lru.begin();
+        e.reply = std::make_shared<CachedReply>(std::move(reply));
+        loaded++;
+        totalBytes += e.bytes;
+        Trim();
+    }
+};
+
+// Resolved addresses per host:port. A stale entry is served while a
+// background lookup refreshes it, so only the first connection to a host
+// waits on DNS.
+struct DnsCache {
+    struct Entry {
+        std::vector<tcp::endpoint> endpoints;
+        std::chrono::steady_clock::time_point resolved;
+        bool refreshing = false;
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    std::chrono::seconds ttl = kDnsTtl;
+
+    // Sets `refresh` when the caller should look the host up again; only
+    // one caller is asked at a time.
+    std::vector<tcp::endpoint> Get(const std::string& key, bool& refresh) {
+        refresh = false;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(key);
+        if (it == entries.end())
+            return {};
+        auto age = std::chrono::steady_clock::now() - it->second.resolved;
+        if (age > ttl + kDnsStaleGrace) {
+            entries.erase(it);
+            return {};
+        }
+        if (age > ttl && !it->second.refreshing)
+            refresh = it->second.refreshing = true;
+        return it->second.endpoints;
+    }
+
+    void Put(const std::string& key, std::vector<tcp::endpoint> endpoints) {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries[key] = {std::move(endpoints), std::chrono::steady_clock::now(), false};
+    }
+
+    void RefreshFailed(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(key);
+        if (it != entries.end())
+            it->second.refreshing = false;
+    }
+};
+
+// TLS sessions per host:port, so reconnects resume instead of running a
+// full handshake. TLS 1.3 servers send tickets after the handshake, so new
+// sessions come from OpenSSL's new-session callback. The file holds
+// session secrets and is kept readable by the owner only.
+struct TlsSessionCache {
+    std::mutex mutex;
+    std::unordered_map<std::string, SSL_SESSION*> sessions;
+    std::filesystem::path path = "tls_sessions.bin";
+    bool dirty = false; // sessions newer than the file
+    std::chrono::steady_clock::time_point lastSave = std::chrono::steady_clock::now();
+
+    ~TlsSessionCache() {
+        if (dirty)
+            Save();
+        for (auto& entry : sessions)
+            SSL_SESSION_free(entry.second);
+    }
+
+    static bool Expired(SSL_SESSION* session) {
+        return SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < (long)std::time(nullptr);
+    }
+
+    // Returns a session to offer with its own reference, or null.
+    SSL_SESSION* Find(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = sessions.find(key);
+        if (it == sessions.end())
+            return nullptr;
+        if (!SSL_SESSION_is_resumable(it->second) || Expired(it->second)) {
+            SSL_SESSION_free(it->second);
+            sessions.erase(it);
+            return nullptr;
+        }
+        SSL_SESSION_up_ref(it->second);
+        return it->second;
+    }
+
+    // Takes ownership of `session`. Runs inside OpenSSL's handshake, so
+    // the file is only rewritten once kTlsSessionSaveInterval has passed.
+    void Store(const std::string& key, SSL_SESSION* session) {
+        std::lock_guard<std::mutex> lock(mutex);
+        SSL_SESSION*& slot = sessions[key];
+        if (slot)
+            SSL_SESSION_free(slot);
+        slot = session;
+        dirty = true;
+        if (std::chrono::steady_clock::now() - lastSave >= kTlsSessionSaveInterval)
+            Save();
+    }
+
+    // Called with mutex held. Each entry is the key and the DER size on
+    // their own lines, followed by the DER bytes.
+    void Save() {
+        dirty = false;
+        lastSave = std::chrono::steady_clock::now();
+        std::filesystem::path tmp = path;
+        tmp += ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            if (!out)
+                return;
+            std::error_code ec;
+            std::filesystem::permissions(tmp, std::filesystem::perms::owner_read |
+                                                  std::filesystem::perms::owner_write, ec);
+            for (auto& [key, session] : sessions) {
+                int len = i2d_SSL_SESSION(session, nullptr);
+                if (len <= 0 || Expired(session))
+                    continue;
+                std::string der(len, '\0');
+                unsigned char* p = reinterpret_cast<unsigned char*>(der.data());
+                i2d_SSL_SESSION(session, &p);
+                out << key << '\n' << len << '\n';
+                out.write(der.data(), der.size());
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmp, path, ec);
+    }
+
+    void Load() {
+        std::ifstream in(path, std::ios::binary);
+        std::string key, len;
+        while (std::getline(in, key) && std::getline(in, len)) {
+            unsigned long size = std::strtoul(len.c_str(), nullptr, 10);
+            if (size == 0 || size > kMaxTlsSessionBytes)
+                break;
+            std::string der(size, '\0');
+            if (!in.read(der.data(), der.size()))
+                break;
+            const unsigned char* p = reinterpret_cast<const unsigned char*>(der.data());
+            SSL_SESSION* session = d2i_SSL_SESSION(nullptr, &p, (long)der.size());
+            if (!session)
+                continue;
+            std::lock_guard<std::mutex> lock(mutex);
+            if (Expired(session) || sessions.count(key))
+                SSL_SESSION_free(session);
+            else
+                sessions[key] = session;
+        }
+    }
+};
+
+// Asio keeps its verify callback in the SSL and SSL_CTX app data, so the
+// session cache and connection live in ex_data slots of their own.
+int SessionCacheIndex() {
+    static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+int ConnectionIndex() {
+    static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+// Client-side view of provider rate limits: one token bucket per API key
+// and model. Buckets start unlimited and learn their size from the
+// X-RateLimit-* headers; a 429 empties the bucket until the server's reset
+// time. Reserving may drive a bucket negative, which queues callers in
+// order behind the slots already handed out.
+struct RateLimiter {
+    struct Bucket {
+        double capacity = 0.0; // 0 until a response reported the limit
+        double tokens = 0.0;
+        double refillPerSec = 0.0;
+        std::chrono::steady_clock::time_point updated;
+        std::chrono::steady_clock::time_point blockedUntil;
+    };
+
+    struct Reservation {
+        std::string key;
+        std::chrono::milliseconds wait{0};
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Bucket> buckets;
+    std::atomic<unsigned> nextKey{0};
+    std::atomic<int> queued{0}; // requests currently waiting for a slot
+
+    // Called with mutex held.
+    Bucket& BucketFor(const std::string& key, const std::string& model,
+                      std::chrono::steady_clock::time_point now) {
+        Bucket& b = buckets[key + "\n" + model];
+        if (b.capacity > 0.0) {
+            double elapsed = std::chrono::duration<double>(now - b.updated).count();
+            b.tokens = std::min(b.capacity, b.tokens + elapsed * b.refillPerSec);
+        }
+        b.updated = now;
+        return b;
+    }
+
+    static std::chrono::milliseconds WaitFor(const Bucket& b, std::chrono::steady_clock::time_point now) {
+        std::chrono::milliseconds wait{0};
+        if (b.blockedUntil > now)
+            wait = std::chrono::ceil<std::chrono::milliseconds>(b.blockedUntil - now);
+        if (b.capacity > 0.0 && b.tokens < 1.0 && b.refillPerSec > 0.0)
+            wait = std::max(wait, std::chrono::milliseconds((long long)std::ceil(
+                                      (1.0 - b.tokens) / b.refillPerSec * 1000.0)));
+        return wait;
+    }
+
+    // Takes a slot on whichever key can send to `model` soonest, rotating
+    // through the keys so equally free ones share the load.
+    Reservation Reserve(const std::vector<std::string>& keys, const std::string& model) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        unsigned start = nextKey++;
+        Reservation best;
+        Bucket* chosen = nullptr;
+        for (size_t i = 0; i < keys.size(); i++) {
+            const std::string& key = keys[(start + i) % keys.size()];
+            Bucket& b = BucketFor(key, model, now);
+            auto wait = WaitFor(b, now);
+            if (!chosen || wait < best.wait) {
+                chosen = &b;
+                best = {key, wait};
+            }
+        }
+        if (chosen && chosen->capacity > 0.0)
+            chosen->tokens -= 1.0;
+        return best;
+    }
+
+    // Fixes a bucket's size rather than learning it from responses, for a
+    // limit of our own.
+    void SetLimit(const std::string& key, const std::string& model, double perMinute) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Bucket& b = BucketFor(key, model, std::chrono::steady_clock::now());
+        b.capacity = b.tokens = perMinute;
+        b.refillPerSec = perMinute / 60.0;
+    }
+
+    // Returns the slot of a request that gave up while queued.
+    void Release(const Reservation& r, const std::string& model) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Bucket& b = BucketFor(r.key, model, std::chrono::steady_clock::now());
+        if (b.capacity > 0.0)
+            b.tokens = std::min(b.capacity, b.tokens + 1.0);
+    }
+
+    // Updates the bucket from a response's rate-limit headers.
+    void Observe(const std::string& key, const std::string& model, int status,
+                 const http::fields& headers, std::chrono::milliseconds retryAfter) {
+        auto number = [&](beast::string_view name) {
+            auto it = headers.find(name);
+            return it == headers.end() ? -1.0 : std::atof(std::string(it->value()).c_str());
+        };
+        double limit = number("X-RateLimit-Limit");
+        double remaining = number("X-RateLimit-Remaining");
+        double reset = number("X-RateLimit-Reset");
+
+        // Reset may be a Unix time in milliseconds or seconds, or a delay.
+        double resetIn = -1.0;
+        double nowSec = std::chrono::duration<double>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        if (reset > 1e12)
+            resetIn = reset / 1000.0 - nowSec;
+        else if (reset > 1e9)
+            resetIn = reset - nowSec;
+        else if (reset >= 0.0)
+            resetIn = reset;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        Bucket& b = BucketFor(key, model, now);
+        if (limit > 0.0) {
+            bool first = b.capacity <= 0.0;
+            b.capacity = limit;
+            double window = std::chrono::duration<double>(kRateLimitWindow).count();
+            b.refillPerSec = limit / window;
+            if (remaining >= 0.0 && remaining < limit && resetIn > 0.0)
+                b.refillPerSec = std::max(b.refillPerSec, (limit - remaining) / resetIn);
+            if (remaining >= 0.0)
+                b.tokens = first ? remaining : std::min(b.tokens, remaining);
+            if (remaining == 0.0 && resetIn > 0.0)
+                b.blockedUntil = std::max(b.blockedUntil,
+                    now + std::chrono::milliseconds((long long)(resetIn * 1000.0)));
+        }
+        if (status == 429) {
+            b.tokens = std::min(b.tokens, 0.0);
+            std::chrono::milliseconds block = retryAfter;
+            if (block.count() < 0)
+                block = std::chrono::milliseconds(
+                    (long long)(std::max(resetIn, 1.0) * 1000.0));
+            b.blockedUntil = std::max(b.blockedUntil, now + block);
+        }
+    }
+};
+
+struct NetClient {
+    ssl::context sslCtx{ssl::context::tls_client};
+    ConnectionPool pool;
+    // Shared with background refreshes, which may outlive the client.
+    std::shared_ptr<DnsCache> dns = std::make_shared<DnsCache>();
+    TlsSessionCache sessions;
+    std::atomic<unsigned> tlsHandshakes{0};
+    std::atomic<unsigned> tlsResumed{0};
+    RateLimiter limiter;
+    RequestTimeouts timeouts;
+    RetryPolicy retry;
+    LatencyTracker ttft;
+    LatencyTracker ttftWarm; // first token over a pooled or pre-warmed connection
+    LatencyTracker ttftCold; // first token after connecting on demand
+    PromptCacheStats promptCache;
+    UsageLedger ledger;
+    Metrics& metrics = GetMetrics();
+    std::atomic<bool> hedging{false};
+    std::atomic<bool> prewarm{true};
+    std::atomic<bool> prewarming{false};
+    std::chrono::steady_clock::time_point lastPrewarm;
+    std::thread prewarmThread;
+    RequestHandle prewarmHandle; // cancelled at shutdown
+    ResponseCache cache;
+
+    NetClient() {
+        sslCtx.set_default_verify_paths();
+        sslCtx.set_verify_mode(ssl::verify_peer);
+
+        SSL_CTX* native = sslCtx.native_handle();
+        SSL_CTX_set_min_proto_version(native, TLS1_2_VERSION);
+        SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_set_ex_data(native, SessionCacheIndex(), &sessions);
+        SSL_CTX_sess_set_new_cb(native, [](SSL* ssl, SSL_SESSION* session) {
+            auto* cache = static_cast<TlsSessionCache*>(
+                SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), SessionCacheIndex()));
+            auto* conn = static_cast<Connection*>(SSL_get_ex_data(ssl, ConnectionIndex()));
+            // Keep a copy: OpenSSL marks the original unresumable when a
+            // connection is dropped without a TLS shutdown.
+            SSL_SESSION* copy = cache && conn ? SSL_SESSION_dup(session) : nullptr;
+            if (copy)
+                cache->Store(conn->host + ":" + conn->port, copy);
+            return 0;
+        });
+        sessions.Load();
+    }
+
+    // A pre-warm still connecting is cancelled rather than left running
+    // against a destroyed client.
+    ~NetClient() {
+        prewarmHandle.cancelled = true;
+        if (prewarmThread.joinable())
+            prewarmThread.join();
+    }
+};
+
+template <size_t N>
+struct HistogramTotals {
+    std::array<std::uint64_t, N + 1> counts{};
+    std::uint64_t sumMicros = 0;
+
+    void Add(const HistogramShard<N>& shard) {
+        for (size_t i = 0; i <= N; i++)
+            counts[i] += shard.counts[i].load(std::memory_order_relaxed);
+        sumMicros += shard.sumMicros.load(std::memory_order_relaxed);
+    }
+
+    // Writes the _bucket, _sum and _count samples; `labels` is empty or
+    // ends with a comma.
+    void Write(std::ostream& out, const char* name, const std::string& labels,
+               const std::array<double, N>& bounds) const {
+        std::uint64_t cumulative = 0;
+        for (size_t i = 0; i <= N; i++) {
+            cumulative += counts[i];
+            out << name << "_bucket{" << labels << "le=\"";
+            if (i < N)
+                out << bounds[i];
+            else
+                out << "+Inf";
+            out << "\"} " << cumulative << '\n';
+        }
+        std::string plain = labels.empty() ? "" : "{" + labels.substr(0, labels.size() - 1) + "}";
+        out << name << "_sum" << plain << ' ' << sumMicros / 1e6 << '\n';
+        out << name << "_count" << plain << ' ' << cumulative << '\n';
+    }
+};
+
+std::string MetricLabel(const std::string& value) {
+    std::string escaped;
+    for (char c : value) {
+        if (c == '\\' || c == '"')
+            escaped += '\\';
+        if (c == '\n') {
+            escaped += "\\n";
+            continue;
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+// Renders the metrics in the Prometheus text exposition format (0.0.4).
+std::string FormatMetrics(NetClient& net, Router& router) {
+    std::vector<HistogramTotals<kLatencyBuckets.size()>> latency(kMetricRoutes);
+    std::vector<HistogramTotals<kTtftBuckets.size()>> ttft(kMetricRoutes);
+    std::vector<std::array<std::uint64_t, 3>> requests(kMetricRoutes);
+    HistogramTotals<kFrameBuckets.size()> frame;
+    std::uint64_t retries = 0, cacheHits = 0, cacheMisses = 0, connectionsOpened = 0;
+    std::int64_t inFlight = 0;
+    net.metrics.shards.ForEach([&](const MetricsShard& shard) {
+        for (size_t r = 0; r < kMetricRoutes; r++) {
+            latency[r].Add(shard.latency[r]);
+            ttft[r].Add(shard.ttft[r]);
+            for (size_t i = 0; i < 3; i++)
+                requests[r][i] += shard.requests[r][i].load(std::memory_order_relaxed);
+        }
+        frame.Add(shard.frame);
+        retries += shard.retries.load(std::memory_order_relaxed);
+        cacheHits += shard.cacheHits.load(std::memory_order_relaxed);
+        cacheMisses += shard.cacheMisses.load(std::memory_order_relaxed);
+        connectionsOpened += shard.connectionsOpened.load(std::memory_order_relaxed);
+        inFlight += shard.inFlight.load(std::memory_order_relaxed);
+    });
+
+    std::vector<std::string> labels;
+    {
+        std::lock_guard<std::mutex> lock(router.mutex);
+        for (size_t r = 0; r < std::min(router.routes.size(), kMetricRoutes); r++) {
+            bool shared = r == kMetricRoutes - 1 && router.routes.size() > kMetricRoutes;
+            const Route& route = router.routes[r];
+            labels.push_back(shared ? "route=\"other\",model=\"\","
+                                    : "route=\"" + MetricLabel(route.name) + "\",model=\"" +
+                                          MetricLabel(route.model) + "\",");
+        }
+    }
+
+    std::ostringstream out;
+    out << "# HELP schoolbot_request_duration_seconds Chat request time from send to last token, retries included.\n"
+        << "# TYPE schoolbot_request_duration_seconds histogram\n";
+    for (size_t r = 0; r < labels.size(); r++)
+        latency[r].Write(out, "schoolbot_request_duration_seconds", labels[r], kLatencyBuckets);
+    out << "# HELP schoolbot_ttft_seconds Time to first token, retries included.\n"
+        << "# TYPE schoolbot_ttft_seconds histogram\n";
+    for (size_t r = 0; r < labels.size(); r++)
+        ttft[r].Write(out, "schoolbot_ttft_seconds", labels[r], kTtftBuckets);
+    out << "# HELP schoolbot_requests_total Finished chat requests.\n"
+        << "# TYPE schoolbot_requests_total counter\n";
+    for (size_t r = 0; r < labels.size(); r++)
+        for (size_t i = 0; i < 3; i++)
+            out << "schoolbot_requests_total{" << labels[r] << "status=\"" << kMetricStatuses[i]
+                << "\"} " << requests[r][i] << '\n';
+    out << "# HELP schoolbot_requests_in_flight Chat requests being sent or streamed.\n"
+        << "# TYPE schoolbot_requests_in_flight gauge\n"
+        << "schoolbot_requests_in_flight " << inFlight << '\n'
+        << "# HELP schoolbot_retries_total Chat request attempts after the first.\n"
+        << "# TYPE schoolbot_retries_total counter\n"
+        << "schoolbot_retries_total " << retries << '\n'
+        << "# HELP schoolbot_response_cache_lookups_total Response cache lookups.\n"
+        << "# TYPE schoolbot_response_cache_lookups_total counter\n"
+        << "schoolbot_response_cache_lookups_total{result=\"hit\"} " << cacheHits << '\n'
+        << "schoolbot_response_cache_lookups_total{result=\"miss\"} " << cacheMisses << '\n'
+        << "# HELP schoolbot_pool_idle_connections Keep-alive connections waiting in the pool.\n"
+        << "# TYPE schoolbot_pool_idle_connections gauge\n"
+        << "schoolbot_pool_idle_connections " << net.pool.idleCount.load() << '\n'
+        << "# HELP schoolbot_connections_opened_total TLS connections opened.\n"
+        << "# TYPE schoolbot_connections_opened_total counter\n"
+        << "schoolbot_connections_opened_total " << connectionsOpened << '\n'
+        << "# HELP schoolbot_frame_seconds Time to build and draw one UI frame.\n"
+        << "# TYPE schoolbot_frame_seconds histogram\n";
+    frame.Write(out, "schoolbot_frame_seconds", "", kFrameBuckets);
+    out << "# HELP schoolbot_history_bytes Memory held by the conversation history.\n"
+        << "# TYPE schoolbot_history_bytes gauge\n"
+        << "schoolbot_history_bytes " << net.metrics.historyBytes.load() << '\n';
+    return out.str();
+}
+
+// Serves FormatMetrics output on 127.0.0.1:`port` and/or rewrites `file`
+// every kMetricsFileInterval for node_exporter's textfile collector. Runs
+// on its own thread and io_context, away from the request paths.
+struct MetricsExporter {
+    net::io_context ioc;
+    std::optional<tcp::acceptor> acceptor;
+    std::optional<net::steady_timer> timer;
+    std::filesystem::path file;
+    std::function<std::string()> render;
+    std::thread thread;
+
+    ~MetricsExporter() { Stop(); }
+
+    // Returns an error message, or "" on success.
+    std::string Start(int port, std::filesystem::path path, std::function<std::string()> r) {
+        render = std::move(r);
+        file = std::move(path);
+        if (port > 0) {
+            beast::error_code ec;
+            tcp::endpoint endpoint(net::ip::address_v4::loopback(), (unsigned short)port);
+            acceptor.emplace(ioc);
+            acceptor->open(endpoint.protocol(), ec);
+            if (!ec)
+                acceptor->set_option(net::socket_base::reuse_address(true), ec);
+            if (!ec)
+                acceptor->bind(endpoint, ec);
+            if (!ec)
+                acceptor->listen(net::socket_base::max_listen_connections, ec);
+            if (ec) {
+                acceptor.reset();
+                return "metrics port " + std::to_string(port) + ": " + ec.message();
+            }
+            Accept();
+        }
+        if (!file.empty()) {
+            timer.emplace(ioc);
+            net::post(ioc, [this] { Tick(); });
+        }
+        if (acceptor || timer)
+            thread = std::thread([this] { ioc.run(); });
+        return "";
+    }
+
+    void Stop() {
+        ioc.stop();
+        if (!thread.joinable())
+            return;
+        thread.join();
+        if (!file.empty())
+            WriteFile();
+    }
+
+    void Accept() {
+        acceptor->async_accept([this](beast::error_code ec, tcp::socket socket) {
+            if (ec == net::error::operation_aborted)
+                return;
+            if (!ec)
+                Serve(std::make_shared<beast::tcp_stream>(std::move(socket)));
+            Accept();
+        });
+    }
+
+    void Serve(std::shared_ptr<beast::tcp_stream> stream) {
+        auto buffer = std::make_shared<beast::flat_buffer>();
+        auto request = std::make_shared<http::request<http::empty_body>>();
+        stream->expires_after(std::chrono::seconds(5));
+        http::async_read(*stream, *buffer, *request,
+            [this, stream, buffer, request](beast::error_code ec, size_t) {
+                if (ec)
+                    return;
+                auto response = std::make_shared<http::response<http::string_body>>(
+                    http::status::ok, request->version());
+                if (request->target() == "/metrics" || request->target() == "/") {
+                    response->set(http::field::content_type, "text/plain; version=0.0.4; charset=utf-8");
+                    response->body() = render();
+                } else {
+                    response->result(http::status::not_found);
+                }
+                response->keep_alive(false);
+                response->prepare_payload();
+                http::async_write(*stream, *response, [stream, response](beast::error_code, size_t) {
+                    beast::error_code ignored;
+                    stream->socket().shutdown(tcp::socket::shutdown_both, ignored);
+                });
+            });
+    }
+
+    void Tick() {
+        WriteFile();
+        timer->expires_after(kMetricsFileInterval);
+        timer->async_wait([this](beast::error_code ec) {
+            if (!ec)
+                Tick();
+        });
+    }
+
+    // Written to a temporary name and renamed, so the collector never reads
+    // a half-written file.
+    void WriteFile() {
+        std::filesystem::path tmp = file;
+        tmp += ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            out << render();
+            if (!out)
+                return;
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmp, file, ec);
+    }
+};
+#endif
+
+#ifndef _WEB_BUILD
+// One route's reply in compare mode.
+struct CompareColumn {
+    int route = -1;
+    std::string name;
+    std::string text;
+    std::string status = "waiting";
+    double ttftMs = -1.0;
+    double tokensPerSec = 0.0;
+    Usage usage;
+    std::shared_ptr<RequestHandle> handle;
+};
+
+// One prompt fanned out to several routes at once. Every column runs on its
+// own thread and pooled connection; `handle` is the parent of all column
+// handles, so Stop cancels the whole fan-out.
+struct CompareSession {
+    std::mutex mutex;
+    std::string prompt;
+    std::vector<CompareColumn> columns;
+    std::shared_ptr<RequestHandle> handle;
+    bool firstCompleteWins = false;
+    int winner = -1;
+    std::atomic<int> running{0};
+};
+
+// Recall: older messages of a long conversation are embedded in the
+// background, and requests whose history window has moved past them bring
+// back the few most similar to the new prompt.
+constexpr size_t kHashEmbeddingDim = 256;
+constexpr size_t kMaxEmbedBytes = 8192; // of each message; the rest is not embedded
+constexpr size_t kEmbedBatch = 16;
+constexpr size_t kRecallMaxMessages = 4;
+constexpr size_t kRecallByteBudget = 4096; // about 1000 tokens
+constexpr float kRecallMinScore = 0.2f;
+// Embedding the prompt holds up its request; past this, it goes without recall.
+constexpr auto kRecallEmbedTimeout = std::chrono::milliseconds(1500);
+
+std::uint64_t Fnv1a(std::string_view s, std::uint64_t h = 1469598103934665603ull) {
+    for (char c : s)
+        h = (h ^ (unsigned char)c) * 1099511628211ull;
+    return h;
+}
+
+// Offline stand-in for an embedding model: signed feature hashing of the
+// folded words and word pairs of `text`, normalised to unit length. Words
+// under three letters carry little topic and are skipped.
+std::vector<float> HashEmbedding(std::string_view text) {
+    std::vector<float> v(kHashEmbeddingDim, 0.0f);
+    std::uint64_t previous = 0;
+    auto add = [&](std::uint64_t h) { v[h % kHashEmbeddingDim] += (h >> 63) ? -1.0f : 1.0f; };
+    ForEachWord(text, [&](size_t begin, size_t end) {
+        if (end - begin < 3)
+            return;
+        std::uint64_t h = 1469598103934665603ull;
+        for (size_t i = begin; i < end; i++)
+            h = (h ^ (unsigned char)FoldChar(text[i])) * 1099511628211ull;
+        add(h);
+        if (previous)
+            add((previous ^ (h >> 1)) * 1099511628211ull);
+        previous = h;
+    });
+    float norm = 0.0f;
+    for (float x : v)
+        norm += x * x;
+    if (norm > 0.0f)
+        for (float& x : v)
+            x /= std::sqrt(norm);
+    return v;
+}
+
+// Dot product of two int8 vectors, 16 lanes at a time where the target has
+// SIMD. Products are summed in 32 bits, exact for any embedding size.
+std::int32_t DotInt8(const std::int8_t* a, const std::int8_t* b, size_t n) {
+    size_t i = 0;
+    std::int32_t sum = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        // Sign-extend to 16 bits, then multiply and add pairs into 32.
+        __m128i xs = _mm_cmpgt_epi8(zero, x);
+        __m128i ys = _mm_cmpgt_epi8(zero, y);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(x, xs), _mm_unpacklo_epi8(y, ys)));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(x, xs), _mm_unpackhi_epi8(y, ys)));
+    }
+    alignas(16) std::int32_t lanes[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (; i + 16 <= n; i += 16) {
+        int8x16_t x = vld1q_s8(a + i);
+        int8x16_t y = vld1q_s8(b + i);
+        acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(x), vget_low_s8(y)));
+        acc = vpadalq_s16(acc, vmull_s8(vget_high_s8(x), vget_high_s8(y)));
+    }
+    sum = vaddvq_s32(acc);
+#endif
+    for (; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+// Unit-length embeddings stored as int8 with one scale per vector, a
+// quarter of the float size; the cosine of two vectors is their int8 dot
+// product times both scales. Rows are keyed by a hash of the embedded text,
+// so a message is embedded once however often it recurs, and appended to
+// `path` so they survive restarts. The file starts with the model and
+// dimension and is discarded when either changes.
+struct EmbeddingIndex {
+    std::string model;
+    size_t dim = 0;
+    std::vector<std::int8_t> values; // dim per row
+    std::vector<float> scales;
+    std::vector<std::uint64_t> hashes;
+    std::unordered_map<std::uint64_t, std::uint32_t> rows; // text hash -> row
+    std::filesystem::path path = "embeddings.bin";
+    size_t saved = 0; // rows already in the file
+
+    static std::uint64_t Hash(std::string_view text) { return Fnv1a(text.substr(0, kMaxEmbedBytes)); }
+
+    int Find(std::uint64_t hash) const {
+        auto it = rows.find(hash);
+        return it == rows.end() ? -1 : (int)it->second;
+    }
+
+    // Quantizes `v` to int8 with a per-vector scale.
+    static float Quantize(const std::vector<float>& v, std::int8_t* out) {
+        float max = 0.0f;
+        for (float x : v)
+            max = std::max(max, std::fabs(x));
+        float scale = max > 0.0f ? max / 127.0f : 1.0f;
+        for (size_t i = 0; i < v.size(); i++)
+            out[i] = (std::int8_t)std::lround(v[i] / scale);
+        return scale;
+    }
+
+    // Returns the row of `v`, or -1 if its size doesn't match the index.
+    int Add(std::uint64_t hash, const std::vector<float>& v) {
+        if (int row = Find(hash); row >= 0)
+            return row;
+        if (dim == 0)
+            dim = v.size();
+        if (v.size() != dim || dim == 0)
+            return -1;
+        values.resize(values.size() + dim);
+        scales.push_back(Quantize(v, values.data() + values.size() - dim));
+        hashes.push_back(hash);
+        return rows[hash] = (std::uint32_t)hashes.size() - 1;
+    }
+
+    float Score(std::uint32_t row, const std::int8_t* query, float queryScale) const {
+        return DotInt8(values.data() + (size_t)row * dim, query, dim) * scales[row] * queryScale;
+    }
+
+    // Each row is its hash, scale and dim int8 values.
+    void Save() {
+        if (saved == hashes.size())
+            return;
+        bool fresh = saved == 0;
+        std::ofstream out(path, std::ios::binary | (fresh ? std::ios::trunc : std::ios::app));
+        if (!out)
+            return;
+        if (fresh)
+            out << "SchoolBot embeddings 1\n" << model << '\n' << dim << '\n';
+        for (; saved < hashes.size(); saved++) {
+            out.write(reinterpret_cast<const char*>(&hashes[saved]), sizeof(hashes[saved]));
+            out.write(reinterpret_cast<const char*>(&scales[saved]), sizeof(scales[saved]));
+            out.write(reinterpret_cast<const char*>(values.data() + saved * dim), dim);
+        }
+    }
+
+    void Load() {
+        std::ifstream in(path, std::ios::binary);
+        std::string magic, fileModel, fileDim;
+        if (!std::getline(in, magic) || magic != "SchoolBot embeddings 1" || !std::getline(in, fileModel) ||
+            fileModel != model || !std::getline(in, fileDim))
+            return;
+        dim = std::strtoul(fileDim.c_str(), nullptr, 10);
+        std::uint64_t hash;
+        float scale;
+        std::vector<std::int8_t> row(dim);
+        while (dim > 0 && in.read(reinterpret_cast<char*>(&hash), sizeof(hash)) &&
+               in.read(reinterpret_cast<char*>(&scale), sizeof(scale)) &&
+               in.read(reinterpret_cast<char*>(row.data()), dim)) {
+            if (rows.count(hash))
+                continue;
+            rows[hash] = (std::uint32_t)hashes.size();
+            hashes.push_back(hash);
+            scales.push_back(scale);
+            values.insert(values.end(), row.begin(), row.end());
+        }
+        saved = hashes.size();
+    }
+};
+
+struct AppContext;
+void RunRecallWorker(AppContext* ctx);
+
+// Messages waiting to be embedded, the worker thread that embeds them and
+// the index it fills. Lock order: historyMutex before mutex.
+struct RecallIndex {
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<bool> enabled{false};
+    bool stopping = false;
+    bool loaded = false; // index read from disk
+    std::deque<const MessageNode*> pending;
+    std::thread worker;
+    EmbeddingIndex index;
+    std::vector<std::int32_t> rowOfNode; // by MessageNode::id; -1 until embedded
+    std::string apiKey; // for the embeddings API, from the latest request
+    std::string lastError;
+    std::atomic<unsigned> recalled{0}; // messages brought back, for the UI
+    RequestHandle handle; // the worker's embedding requests
+
+    ~RecallIndex() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        handle.cancelled = true;
+        wake.notify_all();
+        if (worker.joinable())
+            worker.join();
+    }
+
+    // Called with historyMutex held.
+    void Enqueue(AppContext* ctx, const MessageNode& node) {
+        if (!enabled || node.message.role == "system")
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(&node);
+        if (!worker.joinable())
+            worker = std::thread(RunRecallWorker, ctx);
+        wake.notify_one();
+    }
+
+    // Called with mutex held. Reads the index the first time it is needed,
+    // for the configured embedding model.
+    void Load(const std::optional<Route>& endpoint) {
+        if (loaded)
+            return;
+        loaded = true;
+        index.model = endpoint ? endpoint->model : "hashed-" + std::to_string(kHashEmbeddingDim);
+        index.Load();
+    }
+
+    // Called with mutex held.
+    int RowOf(const MessageNode& node) const {
+        return node.id < rowOfNode.size() ? rowOfNode[node.id] : -1;
+    }
+
+    // Called with mutex held.
+    void SetRow(const MessageNode& node, int row) {
+        if (node.id >= rowOfNode.size())
+            rowOfNode.resize(node.id + 1, -1);
+        rowOfNode[node.id] = row;
+    }
+};
+#endif
+
+// The search box and its results. UI thread only.
+struct SearchView {
+    char query[256] = {};
+    std::vector<std::string> terms; // folded words of the query, for highlighting
+    std::vector<SearchIndex::Result> results;
+    std::vector<const MessageNode*> matched; // results' nodes, sorted
+    std::uint64_t generation = 0;            // index generation the results are from
+    double queryMs = 0.0;
+    const MessageNode* scrollTarget = nullptr; // jumped-to result, scrolled to on the next draw
+};
+
+struct AppContext {
+    Conversation history;
+    SearchIndex searchIndex; // guarded by historyMutex
+    std::mutex historyMutex;
+    char inputBuffer[2048];
+    char apiKeyBuffer[512];
+    std::atomic<bool> isWaiting;
+    bool scrollToBottom;
+    std::shared_ptr<RequestHandle> activeRequest; // guarded by historyMutex
+    Router router;
+    FrameArena frame; // UI thread only
+    std::uint64_t frameAllocations = 0; // heap allocations in the last frame
+    MemoryReport memory; // refreshed about once a second while shown
+    const MessageNode* editing = nullptr; // prompt the input box will replace, UI thread only
+    SearchView search;
+#ifndef _WEB_BUILD
+    // Threads still using this context; main waits for zero before it goes.
+    std::atomic<int> requestThreads{0};
+    NetClient net;
+    bool compareMode = false;
+    bool firstCompleteWins = false;
+    std::vector<char> compareRoutes; // per route index, UI thread only
+    std::shared_ptr<CompareSession> compare;
+    MetricsExporter metricsExporter;
+    RecallIndex recall;
+#endif
+    
+    AppContext() : isWaiting(false), scrollToBottom(false) {
+        memset(inputBuffer, 0, sizeof(inputBuffer));
+        memset(apiKeyBuffer, 0, sizeof(apiKeyBuffer));
+    }
+    
+    // Adds a message at the end of the active branch, or as a new branch
+    // under `parent`.
+    MessageNode* AddMessage(std::string role, std::string content, MessageNode* parent = nullptr) {
+        auto lock = TraceLock(historyMutex, "wait history");
+        MemTagScope tag(MemTag::History);
+        MessageNode* node = history.Add(parent ? parent : history.Leaf(), ChatMessage(role, content));
+        searchIndex.Index(*node, true);
+#ifndef _WEB_BUILD
+        recall.Enqueue(this, *node);
+#endif
+        scrollToBottom = true;
+        return node;
+    }
+
+    // Appends streamed reply text for `req`, creating the assistant message on
+    // the first piece. Returns false once the request has been cancelled, so
+    // nothing lands in history after Stop was pressed.
+    bool AppendReply(RequestHandle& req, const std::string& text, const std::string& model,
+                     bool cached = false) {
+        auto lock = TraceLock(historyMutex, "wait history");
+        if (req.IsCancelled())
+            return false;
+        MemTagScope tag(MemTag::History);
+        if (!req.reply) {
+            req.reply = history.Add(req.anchor ? req.anchor : history.Leaf(),
+                                    ChatMessage("assistant", text, model, cached));
+        } else {
+            ChatMessage& m = req.reply->message;
+            m.content.Append(text);
+            m.fragment.reset();
+            m.breakpointFragment.reset();
+            m.layout.reset();
+        }
+        searchIndex.Index(*req.reply, false);
+        scrollToBottom = true;
+        return true;
+    }
+
+    void FailRequest(RequestHandle& req, std::string error) {
+        auto lock = TraceLock(historyMutex, "wait history");
+        if (req.IsCancelled())
+            return;
+        MemTagScope tag(MemTag::History);
+        MessageNode* parent = req.reply ? req.reply : req.anchor;
+        searchIndex.Index(*history.Add(parent ? parent : history.Leaf(), ChatMessage("system", error)), true);
+        scrollToBottom = true;
+    }
+
+    // Clears the waiting state, unless a newer request has already taken over.
+    void FinishRequest(const std::shared_ptr<RequestHandle>& req) {
+        auto lock = TraceLock(historyMutex, "wait history");
+        if (req && req->reply) {
+            searchIndex.Index(*req->reply, true);
+#ifndef _WEB_BUILD
+            recall.Enqueue(this, *req->reply);
+#endif
+        }
+        if (activeRequest == req) {
+            activeRequest.reset();
+            isWaiting = false;
+        }
+    }
+};
+
+#ifdef _WEB_BUILD
+// Global context pointer for web callbacks (required by Emscripten's C API)
+static AppContext* g_webContext = nullptr;
+#else
+// Bytes the history holds, inline and on the heap, for the metrics.
+size_t HistoryBytes(AppContext* ctx) {
+    auto heap = [](const std::string& s) {
+        return s.capacity() > std::string().capacity() ? s.capacity() + 1 : 0;
+    };
+    auto lock = TraceLock(ctx->historyMutex, "wait history");
+    size_t bytes = 0;
+    ctx->history.ForEachNode([&](const MessageNode& node) {
+        const ChatMessage& m = node.message;
+        bytes += sizeof(MessageNode) + node.children.capacity() * sizeof(node.children[0]);
+        bytes += heap(m.role) + m.content.HeapBytes() + heap(m.model);
+        if (m.fragment)
+            bytes += sizeof(std::string) + heap(*m.fragment);
+        if (m.breakpointFragment)
+            bytes += sizeof(std::string) + heap(*m.breakpointFragment);
+    });
+    return bytes;
+}
+#endif
+
+std::vector<CodeBlock> ExtractCodeBlocks(std::string_view markdown) {
+    std::vector<CodeBlock> blocks;
+    
+    std::regex pattern(R"(```(\w+)?\s*\n([\s\S]*?)```)");
+    
+    auto words_begin = std::cregex_iterator(markdown.data(), markdown.data() + markdown.size(), pattern);
+    auto words_end = std::cregex_iterator();
+    
+    for (std::cregex_iterator i = words_begin; i != words_end; ++i) {
+        std::cmatch match = *i;
+        CodeBlock block;
+        block.language = match[1].matched ? match[1].str() : "plaintext";
+        block.code = match[2].str();
+        
+        size_t end = block.code.find_last_not_of(" \n\r\t");
+        if (end != std::string::npos) {
+            block.code = block.code.substr(0, end + 1);
+        }
+        
+        blocks.push_back(block);
+    }
+    
+    return blocks;
+}
+
+std::vector<HighlightRule> BuildRulesForLanguage(const std::string& lang) {
+    std::vector<HighlightRule> rules;
+    
+    if (lang == "cpp" || lang == "c" || lang == "c++" || lang == "cc" || lang == "cxx") {
+        rules.push_back({
+            std::regex(R"(\b(alignas|alignof|and|and_eq|asm|auto|bitand|bitor|bool|break|case|catch|char|char8_t|char16_t|char32_t|class|compl|concept|const|consteval|constexpr|constinit|const_cast|continue|co_await|co_return|co_yield|decltype|default|delete|do|double|dynamic_cast|else|enum|explicit|export|extern|false|float|for|friend|goto|if|inline|int|long|mutable|namespace|new|noexcept|not|not_eq|nullptr|operator|or|or_eq|private|protected|public|register|reinterpret_cast|requires|return|short|signed|sizeof|static|static_assert|static_cast|struct|switch|template|this|thread_local|throw|true|try|typedef|typeid|typename|union|unsigned|using|virtual|void|volatile|wchar_t|while|xor|xor_eq)\b)"),
+            ImVec4(0.86f, 0.47f, 0.86f, 1.0f)
+        });
+        rules.push_back({
+            std::regex(R"(^\s*#\s*\w+)"),
+            ImVec4(0.7f, 0.7f, 0.4f, 1.0f)
+        });
+        rules.push_back({
+            std::regex(R"("(?:[^"\\]|\\.)*")"),
+            ImVec4(0.9f, 0.7f, 0.4f, 1.0f)
+        });
+        rules.push_back({
+            std::regex(R"(//[^\n]*)"),
+            ImVec4(0.5f, 0.5f, 0.5f, 1.0f)
+        });
+        rules.push_back({
+            std::regex(R"(\b\d+\.?\d*f?\b)"),
+            ImVec4(0.6f, 0.85f, 0.6f, 1.0f)
+        });
+        rules.push_back({
+            std::regex(R"(\b\w+(?=\s*\())"),
+            ImVec4(0.8f, 0.8f, 0.5f, 1.0f)
+        });
+    } 
+    else if (lang == "python" || lang == "py") {
+        rules.push_back({
+            std::regex(R"(\b(False|None|True|and|as|assert|async|await|break|class|continue|def|del|elif|else|except|finally|for|from|global|if|import|in|is|lambda|nonlocal|not|or|pass|raise|return|try|while|with|yield)\b)"),
+            ImVec4(0.86f, 0.47f, 0.86f, 1.0f)
+        });
+        rules.push_back({
+            std::regex(R"((?:"(?:[^"\\]|\\.)*"|'(?:[^'\\]|\\.)*'))"),
+            ImVec4(0.9f, 0.7f, 0.4f, 1.0f)
+        });
+        rules.push_back({
+            std::regex(R"(#[^\n]*)"),
+            ImVec4(0.5f, 0.5f, 0.5f, 1.0f)
+        });
+        rules.push_back({
+            std::regex(R"(\b\d+\.?\d*\b)"),
+            ImVec4(0.6f, 0.85f, 0.6f, 1.0f)
+        });
+        rules.push_back({
+            std::regex(R"(\bdef\s+(\w+))"),
+            ImVec4(0.8f, 0.8f, 0.5f, 1.0f),
+            1
+        });
+    }
+    else if (lang == "javascript" || lang == "js" || lang == "typescript" || lang == "ts") {
+        rules.push_back({
+            std::regex(R"(\b(async|await|break|case|catch|class|const|continue|debugger|default|delete|do|else|enum|export|extends|false|finally|for|function|if|import|in|instanceof|let|new|null|return|super|switch|this|throw|true|try|typeof|var|void|while|with|yield)\b)"),
+            ImVec4(0.86f, 0.47f, 0.86f, 1.0f)
+        });
+        rules.push_back({
+            std::regex(R"((?:"(?:[^"\\]|\\.)*"|'(?:[^'\\]|\\.)*'|`(?:[^`\\]|\\.)*`))"),
+            ImVec4(0.9f, 0.7f, 0.4f, 1.0f)
+        });
+        rules.push_back({
+            std::regex(R"(//[^\n]*)"),
+            ImVec4(0.5f, 0.5f, 0.5f, 1.0f)
+        });
+        rules.push_back({
+            std::regex(R"(\b\d+\.?\d*\b)"),
+            ImVec4(0.6f, 0.85f, 0.6f, 1.0f)
+        });
+    }
+    else if (lang == "java") {
+        rules.push_back({
+            std::regex(R"(\b(abstract|assert|boolean|break|byte|case|catch|char|class|const|continue|default|do|double|else|enum|extends|final|finally|float|for|goto|if|implements|import|instanceof|int|interface|long|native|new|package|private|protected|public|return|short|static|strictfp|super|switch|synchronized|this|throw|throws|transient|try|void|volatile|while)\b)"),
+            ImVec4(0.86f, 0.47f, 0.86f, 1.0f)
+        });
+        rules.push_back({
+            std::regex(R"("(?:[^"\\]|\\.)*")"),
+            ImVec4(0.9f, 0.7f, 0.4f, 1.0f)
+        });
+        rules.push_back({
+            std::regex(R"(//[^\n]*)"),
+            ImVec4(0.5f, 0.5f, 0.5f, 1.0f)
+        });
+        rules.push_back({
+            std::regex(R"(\b\d+\.?\d*[fFdDlL]?\b)"),
+            ImVec4(0.6f, 0.85f, 0.6f, 1.0f)
+        });
+    }
+    else if (lang == "rust" || lang == "rs") {
         rules.push_back({
             std::regex(R"(\b(as|async|await|break|const|continue|crate|dyn|else|enum|extern|false|fn|for|if|impl|in|let|loop|match|mod|move|mut|pub|ref|return|self|Self|static|struct|super|trait|true|type|unsafe|use|where|while)\b)"),
             ImVec4(0.86f, 0.47f, 0.86f, 1.0f)
@@ -217,229 +2972,2631 @@ std::vector<HighlightRule> GetRulesForLanguage(const std::string& lang) {
             ImVec4(0.6f, 0.85f, 0.6f, 1.0f)
         });
     }
-    
-    return rules;
+    
+    return rules;
+}
+
+// Compiled once per language name. UI thread only.
+const std::vector<HighlightRule>& GetRulesForLanguage(const std::string& lang) {
+    static std::deque<std::pair<std::string, std::vector<HighlightRule>>> compiled;
+    for (const auto& [name, rules] : compiled)
+        if (name == lang)
+            return rules;
+    compiled.emplace_back(lang, BuildRulesForLanguage(lang));
+    return compiled.back().second;
+}
+
+MessageLayout::Code LayoutCode(CodeBlock block) {
+    TraceSpan span("highlight", "ui");
+    const auto& rules = GetRulesForLanguage(block.language);
+    MessageLayout::Code code;
+    code.numLines = std::count(block.code.begin(), block.code.end(), '\n') + 3;
+
+    size_t lineStart = 0;
+    while (lineStart < block.code.size()) {
+        size_t lineEnd = block.code.find('\n', lineStart);
+        if (lineEnd == std::string::npos)
+            lineEnd = block.code.size();
+        MessageLayout::CodeLine line;
+        line.begin = (int)lineStart;
+        line.end = (int)lineEnd;
+
+        std::vector<Highlight> highlights;
+        auto first = block.code.cbegin() + lineStart;
+        auto last = block.code.cbegin() + lineEnd;
+        for (const auto& rule : rules) {
+            for (std::sregex_iterator it(first, last, rule.pattern), end; it != end; ++it) {
+                if (!(*it)[rule.group].matched)
+                    continue;
+                Highlight h;
+                h.start = (int)it->position(rule.group);
+                h.end = h.start + (int)it->length(rule.group);
+                h.color = rule.color;
+                highlights.push_back(h);
+            }
+        }
+        std::sort(highlights.begin(), highlights.end());
+        int lastEnd = 0;
+        for (const auto& h : highlights) {
+            if (h.start >= lastEnd) {
+                line.highlights.push_back(h);
+                lastEnd = h.end;
+            }
+        }
+        code.lines.push_back(std::move(line));
+        lineStart = lineEnd + 1;
+    }
+    code.language = std::move(block.language);
+    code.code = std::move(block.code);
+    return code;
+}
+
+std::shared_ptr<const MessageLayout> BuildMessageLayout(std::string_view content) {
+    MemTagScope tag(MemTag::Render);
+    auto layout = std::make_shared<MessageLayout>();
+    auto codeBlocks = ExtractCodeBlocks(content);
+    auto addProse = [&](size_t begin, size_t end) {
+        if (end > begin && !(end - begin == 1 && content[begin] == '\n'))
+            layout->parts.push_back({begin, end, -1});
+    };
+    if (codeBlocks.empty()) {
+        layout->parts.push_back({0, content.size(), -1});
+        return layout;
+    }
+
+    static const std::regex pattern(R"(```\w*\s*\n[\s\S]*?```)");
+    size_t pos = 0;
+    size_t blockIdx = 0;
+    for (std::cregex_iterator it(content.data(), content.data() + content.size(), pattern), end; it != end; ++it) {
+        addProse(pos, it->position());
+        if (blockIdx < codeBlocks.size()) {
+            layout->parts.push_back({0, 0, (int)layout->codes.size()});
+            layout->codes.push_back(LayoutCode(std::move(codeBlocks[blockIdx++])));
+        }
+        pos = it->position() + it->length();
+    }
+    addProse(pos, content.size());
+    return layout;
+}
+
+// Draws one line as a run of text segments, coloured where highlighted.
+void RenderHighlightedLine(const std::string& code, const MessageLayout::CodeLine& line) {
+    const char* text = code.c_str() + line.begin;
+    int length = line.end - line.begin;
+    if (length == 0) {
+        ImGui::TextUnformatted("");
+        return;
+    }
+    bool first = true;
+    auto segment = [&](int from, int to, const ImVec4* color) {
+        if (!first)
+            ImGui::SameLine(0, 0);
+        first = false;
+        if (color)
+            ImGui::PushStyleColor(ImGuiCol_Text, *color);
+        ImGui::TextUnformatted(text + from, text + to);
+        if (color)
+            ImGui::PopStyleColor();
+    };
+    int pos = 0;
+    for (const auto& h : line.highlights) {
+        if (h.start > pos)
+            segment(pos, h.start, nullptr);
+        segment(h.start, h.end, &h.color);
+        pos = h.end;
+    }
+    if (pos < length)
+        segment(pos, length, nullptr);
+}
+
+#ifndef _WEB_BUILD
+struct OpResult {
+    beast::error_code ec;
+    std::size_t bytes = 0;
+};
+
+// Failure of one request attempt. Transport errors and the HTTP statuses
+// that usually clear up on their own (429, 5xx) are retryable; `retryAfter`
+// carries the server's Retry-After hint when it sent one.
+struct RequestError : std::runtime_error {
+    int status = 0;
+    bool retryable = false;
+    std::chrono::milliseconds retryAfter{-1};
+
+    RequestError(const std::string& what, int status, bool retryable)
+        : std::runtime_error(what), status(status), retryable(retryable) {}
+};
+
+[[noreturn]] void ThrowTransportError(const RequestHandle& req, const char* phase, beast::error_code ec) {
+    std::string what = std::string(phase) + ": " + ec.message();
+    RecordFlight(req, FlightEvent::TransportError, ec.value(), what);
+    throw RequestError(what, 0, true);
+}
+
+// Runs one async operation to completion on `ioc`, waking every
+// kCancelPollInterval to check the request's cancel flag and the phase
+// (or request) deadline. Either one invokes `abort` to fail the pending operation;
+// the result is then operation_aborted or beast::error::timeout.
+template <class Start, class Abort>
+OpResult RunOp(net::io_context& ioc, const RequestHandle& req,
+               std::chrono::milliseconds timeout, Start&& start, Abort&& abort) {
+    OpResult result;
+    bool finished = false;
+    bool aborted = false;
+    bool timedOut = false;
+    auto deadline = std::min(std::chrono::steady_clock::now() + timeout, req.deadline);
+    ioc.restart();
+    start([&](beast::error_code ec, std::size_t bytes) {
+        result = {ec, bytes};
+        finished = true;
+    });
+    while (!finished) {
+        if (!aborted && req.IsCancelled()) {
+            abort();
+            aborted = true;
+        } else if (!aborted && std::chrono::steady_clock::now() >= deadline) {
+            abort();
+            aborted = true;
+            timedOut = true;
+        }
+        ioc.run_one_for(kCancelPollInterval);
+    }
+    if (timedOut)
+        result.ec = beast::error::timeout;
+    else if (aborted)
+        result.ec = net::error::operation_aborted;
+    return result;
+}
+
+template <class Start>
+OpResult RunStreamOp(Connection& conn, const RequestHandle& req,
+                     std::chrono::milliseconds timeout, Start&& start) {
+    return RunOp(conn.ioc, req, timeout, std::forward<Start>(start),
+                 [&] { beast::get_lowest_layer(conn.stream).cancel(); });
+}
+
+// Orders addresses for connection racing: alternate address families,
+// starting with whichever family the resolver listed first.
+std::vector<tcp::endpoint> InterleaveFamilies(const std::vector<tcp::endpoint>& endpoints) {
+    std::vector<tcp::endpoint> first, other;
+    for (const auto& ep : endpoints)
+        (ep.address().is_v6() == endpoints.front().address().is_v6() ? first : other).push_back(ep);
+    std::vector<tcp::endpoint> ordered;
+    for (size_t i = 0; i < std::max(first.size(), other.size()); i++) {
+        if (i < first.size())
+            ordered.push_back(first[i]);
+        if (i < other.size())
+            ordered.push_back(other[i]);
+    }
+    return ordered;
+}
+
+// Happy Eyeballs (RFC 8305). Connection attempts start `attemptDelay`
+// apart, or as soon as one fails, and run in parallel; the
+// first socket to connect wins and the rest are closed. Losers complete
+// later on the same io_context, so each handler keeps the race alive and
+// ignores results once `done` has been called.
+struct ConnectRace : std::enable_shared_from_this<ConnectRace> {
+    net::io_context& ioc;
+    std::vector<tcp::endpoint> endpoints;
+    std::chrono::milliseconds attemptDelay;
+    std::vector<std::unique_ptr<tcp::socket>> sockets;
+    net::steady_timer timer;
+    size_t next = 0;
+    size_t failed = 0;
+    std::function<void(beast::error_code, tcp::socket*)> done;
+
+    ConnectRace(net::io_context& ioc, std::vector<tcp::endpoint> eps, std::chrono::milliseconds delay)
+        : ioc(ioc), endpoints(InterleaveFamilies(eps)), attemptDelay(delay), timer(ioc) {}
+
+    void Launch() {
+        if (!done)
+            return;
+        if (endpoints.empty()) {
+            Finish(net::error::host_not_found, nullptr);
+            return;
+        }
+        if (next == endpoints.size())
+            return;
+        sockets.push_back(std::make_unique<tcp::socket>(ioc));
+        tcp::socket* socket = sockets.back().get();
+        socket->async_connect(endpoints[next++], [self = shared_from_this(), socket](beast::error_code ec) {
+            self->OnConnect(ec, socket);
+        });
+        timer.expires_after(attemptDelay);
+        timer.async_wait([self = shared_from_this()](beast::error_code ec) {
+            if (!ec)
+                self->Launch();
+        });
+    }
+
+    void OnConnect(beast::error_code ec, tcp::socket* socket) {
+        if (!done)
+            return;
+        if (!ec)
+            Finish({}, socket);
+        else if (++failed == endpoints.size())
+            Finish(ec, nullptr);
+        else
+            Launch(); // a failure starts the next attempt without waiting
+    }
+
+    void Finish(beast::error_code ec, tcp::socket* winner) {
+        auto callback = std::move(done);
+        done = nullptr;
+        beast::error_code ignored;
+        timer.cancel();
+        for (auto& socket : sockets)
+            if (socket.get() != winner)
+                socket->close(ignored);
+        callback(ec, winner);
+    }
+
+    void Abort() {
+        if (done)
+            Finish(net::error::operation_aborted, nullptr);
+    }
+};
+
+std::unique_ptr<Connection> OpenConnection(NetClient& netClient, const std::string& host,
+                                           const std::string& port, const RequestHandle& req, bool tls = true) {
+    auto conn = std::make_unique<Connection>(netClient.sslCtx, host, port);
+    conn->tls = tls;
+    const RequestTimeouts& timeouts = netClient.timeouts;
+    const std::string key = host + ":" + port;
+    SSL* ssl = conn->stream.native_handle();
+
+    if (tls && !SSL_set_tlsext_host_name(ssl, host.c_str())) {
+        beast::error_code ec{static_cast<int>(::ERR_get_error()),
+                             net::error::get_ssl_category()};
+        throw beast::system_error{ec};
+    }
+    SSL_set_ex_data(ssl, ConnectionIndex(), conn.get());
+    if (SSL_SESSION* session = tls ? netClient.sessions.Find(key) : nullptr) {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+
+    bool refresh = false;
+    std::vector<tcp::endpoint> endpoints = netClient.dns->Get(key, refresh);
+    if (refresh) {
+        std::thread([dns = netClient.dns, host, port, key] {
+            MemTagScope tag(MemTag::Network);
+            net::io_context ioc;
+            tcp::resolver resolver(ioc);
+            beast::error_code ec;
+            auto results = resolver.resolve(host, port, ec);
+            if (ec || results.empty()) {
+                dns->RefreshFailed(key);
+                return;
+            }
+            std::vector<tcp::endpoint> fresh;
+            for (const auto& entry : results)
+                fresh.push_back(entry.endpoint());
+            dns->Put(key, std::move(fresh));
+        }).detach();
+    }
+    if (endpoints.empty()) {
+        TraceSpan span("resolve", "net");
+        tcp::resolver resolver(conn->ioc);
+        OpResult r = RunOp(conn->ioc, req, timeouts.resolve, [&](auto done) {
+            resolver.async_resolve(host, port,
+                [&endpoints, done](beast::error_code ec, tcp::resolver::results_type res) {
+                    for (const auto& entry : res)
+                        endpoints.push_back(entry.endpoint());
+                    done(ec, 0);
+                });
+        }, [&] { resolver.cancel(); });
+        if (r.ec)
+            ThrowTransportError(req, "resolve", r.ec);
+        netClient.dns->Put(key, endpoints);
+    }
+
+    auto race = std::make_shared<ConnectRace>(conn->ioc, endpoints, timeouts.connectAttemptDelay);
+    TraceSpan connectSpan("connect", "net");
+    OpResult r = RunOp(conn->ioc, req, timeouts.connect, [&](auto done) {
+        race->done = [&conn, done](beast::error_code ec, tcp::socket* winner) {
+            if (winner)
+                beast::get_lowest_layer(conn->stream).socket() = std::move(*winner);
+            done(ec, 0);
+        };
+        race->Launch();
+    }, [&] { race->Abort(); });
+    if (r.ec)
+        ThrowTransportError(req, "connect", r.ec);
+    if (!tls) {
+        netClient.metrics.Local().connectionsOpened.fetch_add(1, std::memory_order_relaxed);
+        return conn;
+    }
+
+    {
+        TraceSpan span("tls handshake", "net");
+        r = RunStreamOp(*conn, req, timeouts.handshake, [&](auto done) {
+            conn->stream.async_handshake(ssl::stream_base::client,
+                [done](beast::error_code ec) { done(ec, 0); });
+        });
+    }
+    if (r.ec)
+        ThrowTransportError(req, "handshake", r.ec);
+    netClient.tlsHandshakes++;
+    if (SSL_session_reused(ssl))
+        netClient.tlsResumed++;
+    netClient.metrics.Local().connectionsOpened.fetch_add(1, std::memory_order_relaxed);
+
+    return conn;
+}
+
+// Splits an OpenAI-style server-sent event stream into its `data:` payloads.
+// Bytes may arrive in arbitrary pieces; an incomplete line is kept until the
+// rest of it shows up.
+struct SseParser {
+    std::string pending;
+
+    template <class OnData>
+    void Feed(const char* data, std::size_t size, OnData&& onData) {
+        pending.append(data, size);
+        std::size_t start = 0;
+        std::size_t nl;
+        while ((nl = pending.find('\n', start)) != std::string::npos) {
+            std::string_view line(pending.data() + start, nl - start);
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            if (line.substr(0, 5) == "data:") {
+                line.remove_prefix(5);
+                if (!line.empty() && line.front() == ' ')
+                    line.remove_prefix(1);
+                onData(line);
+            }
+            start = nl + 1;
+        }
+        pending.erase(0, start);
+    }
+};
+
+// Request bodies smaller than this aren't worth compressing.
+constexpr std::size_t kGzipMinBody = 8 * 1024;
+
+std::uint32_t Crc32(std::uint32_t crc, const void* data, std::size_t size) {
+    static const auto table = [] {
+        std::array<std::uint32_t, 256> t{};
+        for (std::uint32_t i = 0; i < 256; i++) {
+            std::uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    const auto* p = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+    for (std::size_t i = 0; i < size; i++)
+        crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Decodes a gzip body (RFC 1952) as it arrives. Beast's inflater only does
+// raw deflate, so the header and the CRC-32/length trailer are handled
+// here. Output is passed on as soon as the inflater produces it, which
+// keeps SSE replies streaming when the server flushes per event.
+struct GzipDecoder {
+    enum class State { Header, Body, Trailer, Done };
+    State state = State::Header;
+    std::string pending; // header or trailer bytes not yet complete
+    beast::zlib::inflate_stream inflater;
+    std::uint32_t crc = 0;
+    std::uint32_t length = 0;
+
+    // Length of the complete header in `pending`, or 0 if it is still short.
+    std::size_t HeaderLength() const {
+        const auto* h = reinterpret_cast<const unsigned char*>(pending.data());
+        if (pending.size() < 10)
+            return 0;
+        if (h[0] != 0x1f || h[1] != 0x8b || h[2] != 8)
+            throw std::runtime_error("gzip: bad header");
+        std::size_t pos = 10;
+        if (h[3] & 4) { // FEXTRA
+            if (pending.size() < pos + 2)
+                return 0;
+            pos += 2 + (h[pos] | h[pos + 1] << 8);
+        }
+        for (int flag : {8, 16}) { // FNAME, FCOMMENT
+            if (!(h[3] & flag))
+                continue;
+            std::size_t end = pending.find('\0', pos);
+            if (end == std::string::npos)
+                return 0;
+            pos = end + 1;
+        }
+        if (h[3] & 2) // FHCRC
+            pos += 2;
+        return pending.size() >= pos ? pos : 0;
+    }
+
+    template <class OnData>
+    void Feed(const char* data, std::size_t size, OnData&& onData) {
+        if (state == State::Header) {
+            pending.append(data, size);
+            std::size_t header = HeaderLength();
+            if (header == 0)
+                return;
+            std::string rest = pending.substr(header);
+            pending.clear();
+            state = State::Body;
+            Feed(rest.data(), rest.size(), onData);
+            return;
+        }
+        if (state == State::Body) {
+            beast::zlib::z_params zs;
+            zs.next_in = data;
+            zs.avail_in = size;
+            char out[16384];
+            for (;;) {
+                zs.next_out = out;
+                zs.avail_out = sizeof(out);
+                beast::error_code ec;
+                inflater.write(zs, beast::zlib::Flush::sync, ec);
+                std::size_t produced = sizeof(out) - zs.avail_out;
+                crc = Crc32(crc, out, produced);
+                length += (std::uint32_t)produced;
+                if (produced > 0)
+                    onData(out, produced);
+                if (ec == beast::zlib::error::end_of_stream) {
+                    state = State::Trailer;
+                    break;
+                }
+                if (ec && ec != beast::zlib::error::need_buffers)
+                    throw std::runtime_error("gzip: " + ec.message());
+                if (zs.avail_in == 0 && zs.avail_out > 0)
+                    return;
+                if (ec == beast::zlib::error::need_buffers && produced == 0)
+                    return;
+            }
+            data = static_cast<const char*>(zs.next_in);
+            size = zs.avail_in;
+        }
+        if (state == State::Trailer) {
+            pending.append(data, size);
+            if (pending.size() < 8)
+                return;
+            const auto* t = reinterpret_cast<const unsigned char*>(pending.data());
+            std::uint32_t wantCrc = t[0] | t[1] << 8 | t[2] << 16 | (std::uint32_t)t[3] << 24;
+            std::uint32_t wantLength = t[4] | t[5] << 8 | t[6] << 16 | (std::uint32_t)t[7] << 24;
+            if (wantCrc != crc || wantLength != length)
+                throw std::runtime_error("gzip: corrupt body");
+            state = State::Done;
+        }
+    }
+};
+
+// Compresses a body into gzip chunk by chunk. `onChunk` receives output
+// whenever the buffer fills, and the rest from Finish().
+struct GzipEncoder {
+    beast::zlib::deflate_stream deflater;
+    std::uint32_t crc = 0;
+    std::uint32_t length = 0;
+    char out[16384];
+    std::size_t used = 0;
+
+    GzipEncoder() {
+        deflater.reset(6, 15, 8, beast::zlib::Strategy::normal);
+        static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255};
+        std::memcpy(out, header, sizeof(header));
+        used = sizeof(header);
+    }
+
+    template <class OnChunk>
+    void Run(const void* data, std::size_t size, beast::zlib::Flush flush, OnChunk&& onChunk) {
+        beast::zlib::z_params zs;
+        zs.next_in = data;
+        zs.avail_in = size;
+        for (;;) {
+            zs.next_out = out + used;
+            zs.avail_out = sizeof(out) - used;
+            beast::error_code ec;
+            deflater.write(zs, flush, ec);
+            used = sizeof(out) - zs.avail_out;
+            if (ec && ec != beast::zlib::error::need_buffers && ec != beast::zlib::error::end_of_stream)
+                throw std::runtime_error("gzip: " + ec.message());
+            if (used == sizeof(out)) {
+                onChunk(out, used);
+                used = 0;
+                continue;
+            }
+            if (zs.avail_in == 0 && (flush != beast::zlib::Flush::finish || ec == beast::zlib::error::end_of_stream))
+                return;
+        }
+    }
+
+    template <class OnChunk>
+    void Write(const void* data, std::size_t size, OnChunk&& onChunk) {
+        crc = Crc32(crc, data, size);
+        length += (std::uint32_t)size;
+        Run(data, size, beast::zlib::Flush::none, onChunk);
+    }
+
+    template <class OnChunk>
+    void Finish(OnChunk&& onChunk) {
+        Run(nullptr, 0, beast::zlib::Flush::finish, onChunk);
+        unsigned char trailer[8];
+        for (int i = 0; i < 4; i++) {
+            trailer[i] = (unsigned char)(crc >> (8 * i));
+            trailer[4 + i] = (unsigned char)(length >> (8 * i));
+        }
+        if (used + sizeof(trailer) > sizeof(out)) {
+            onChunk(out, used);
+            used = 0;
+        }
+        std::memcpy(out + used, trailer, sizeof(trailer));
+        used += sizeof(trailer);
+        onChunk(out, used);
+        used = 0;
+    }
+};
+
+std::string ExtractErrorMessage(const std::string& body) {
+    json::error_code ec;
+    json::value jv = json::parse(body, ec);
+    if (!ec && jv.is_object()) {
+        if (auto* err = jv.as_object().if_contains("error")) {
+            if (err->is_object()) {
+                if (auto* msg = err->as_object().if_contains("message"))
+                    if (msg->is_string())
+                        return json::value_to<std::string>(*msg);
+            }
+        }
+    }
+    return body.substr(0, 200);
+}
+
+// A chat completion body kept in pieces: the model and options around the
+// shared message fragments. It goes out as one gathered write, so the
+// conversation is never copied into a request string.
+struct ChatBody {
+    std::string head; // {"model":...,"messages":[
+    MessageFragments messages;
+    std::string tail; // ],"stream":true,...}
+
+    std::vector<net::const_buffer> Buffers() const {
+        static const char comma = ',';
+        std::vector<net::const_buffer> buffers;
+        buffers.reserve(messages.size() * 2 + 2);
+        buffers.push_back(net::buffer(head));
+        for (size_t i = 0; i < messages.size(); i++) {
+            if (i > 0)
+                buffers.push_back(net::buffer(&comma, 1));
+            buffers.push_back(net::buffer(*messages[i]));
+        }
+        buffers.push_back(net::buffer(tail));
+        return buffers;
+    }
+
+    std::size_t Size() const { return net::buffer_size(Buffers()); }
+};
+
+// A pooled connection to the route's endpoint if there is one, a new one
+// otherwise; req.warmConnection records which.
+std::unique_ptr<Connection> AcquireConnection(NetClient& netClient, RequestHandle& req, const Route& route) {
+    std::unique_ptr<Connection> conn = netClient.pool.Acquire(route.host, route.port);
+    req.warmConnection = conn != nullptr;
+    if (!conn)
+        conn = OpenConnection(netClient, route.host, route.port, req, route.tls);
+    return conn;
+}
+
+// Runs `exchange` (write the request, read the response head) on `conn`.
+// A server may drop a pooled connection while it sits idle, which only
+// shows on first use; such a failure is retried once on a fresh one.
+template <class Exchange>
+OpResult ExchangeWithRetry(NetClient& netClient, RequestHandle& req, const Route& route,
+                           std::unique_ptr<Connection>& conn, Exchange&& exchange) {
+    OpResult r = exchange();
+    if (r.ec && r.ec != beast::error::timeout && req.warmConnection && !req.IsCancelled()) {
+        conn = OpenConnection(netClient, route.host, route.port, req, route.tls);
+        req.warmConnection = false;
+        r = exchange();
+    }
+    return r;
+}
+
+// Sends one streaming chat completion and feeds reply text to `onText` as it
+// arrives. Reuses a pooled keep-alive connection when one is available and
+// hands it back afterwards; a cancelled request tears its connection down
+// instead, since the rest of the response is still in flight. Returns the
+// reply's token usage when the provider sends it.
+template <class OnText>
+Usage StreamChatCompletion(NetClient& netClient, RequestHandle& req, const Route& route,
+                          const ChatBody& body, const std::string& apiKey, OnText&& onText) {
+    TraceSpan span("attempt", "net");
+    const std::string& host = route.host;
+    const std::string& port = route.port;
+    http::request<http::empty_body> httpReq{http::verb::post, route.target, 11};
+    httpReq.set(http::field::host, host);
+    httpReq.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+    httpReq.set(http::field::content_type, "application/json");
+    httpReq.set(http::field::accept, "text/event-stream");
+    httpReq.set(http::field::accept_encoding, "gzip");
+    httpReq.set(http::field::authorization, "Bearer " + apiKey);
+    httpReq.keep_alive(true);
+    std::vector<net::const_buffer> buffers = body.Buffers();
+    // Compressed bodies go out chunked as the deflater produces them, so
+    // their size isn't known up front.
+    bool gzipBody = route.gzipRequests && net::buffer_size(buffers) >= kGzipMinBody;
+    if (gzipBody) {
+        httpReq.set(http::field::content_encoding, "gzip");
+        httpReq.chunked(true);
+    } else {
+        httpReq.content_length(net::buffer_size(buffers));
+    }
+    std::ostringstream header;
+    header << httpReq.base();
+    std::string headerText = header.str();
+    buffers.insert(buffers.begin(), net::buffer(headerText));
+    RecordFlight(req, FlightEvent::RequestStart, (std::int32_t)body.Size(),
+                 route.model + " " + host + ":" + port + route.target + (gzipBody ? " gzip" : ""));
+    auto attemptStart = std::chrono::steady_clock::now();
+
+    Usage usage;
+    std::unique_ptr<Connection> conn = AcquireConnection(netClient, req, route);
+    if (req.IsCancelled()) {
+        netClient.pool.Release(std::move(conn));
+        return usage;
+    }
+
+    std::optional<http::response_parser<http::buffer_body>> parser;
+    const char* phase = "write";
+    auto sendRequest = [&] {
+        std::optional<TraceSpan> span(std::in_place, "write", "net");
+        parser.emplace();
+        // Not boost::none: some Beast versions compare Content-Length
+        // against an empty optional and reject every sized body.
+        parser->body_limit(std::numeric_limits<std::uint64_t>::max());
+        OpResult r;
+        if (gzipBody) {
+            auto writeChunk = [&](auto&& buffer) {
+                if (r.ec)
+                    return;
+                r = RunStreamOp(*conn, req, netClient.timeouts.write, [&](auto done) {
+                    conn->Use([&](auto& stream) { net::async_write(stream, buffer, done); });
+                });
+                req.AddBytes(r.bytes, 0);
+            };
+            writeChunk(net::buffer(headerText));
+            GzipEncoder encoder;
+            auto onChunk = [&](const char* data, std::size_t size) {
+                writeChunk(http::make_chunk(net::const_buffer(data, size)));
+            };
+            for (size_t i = 1; i < buffers.size() && !r.ec; i++)
+                encoder.Write(buffers[i].data(), buffers[i].size(), onChunk);
+            if (!r.ec)
+                encoder.Finish(onChunk);
+            writeChunk(http::make_chunk_last());
+        } else {
+            r = RunStreamOp(*conn, req, netClient.timeouts.write, [&](auto done) {
+                conn->Use([&](auto& stream) { net::async_write(stream, buffers, done); });
+            });
+            req.AddBytes(r.bytes, 0);
+        }
+        if (r.ec) {
+            phase = "write";
+            return r;
+        }
+        phase = "first byte";
+        span.emplace("first byte", "net");
+        r = RunStreamOp(*conn, req, netClient.timeouts.firstByte, [&](auto done) {
+            conn->Use([&](auto& stream) { http::async_read_header(stream, conn->buffer, *parser, done); });
+        });
+        req.AddBytes(0, r.bytes);
+        return r;
+    };
+
+    OpResult r = ExchangeWithRetry(netClient, req, route, conn, sendRequest);
+    if (req.IsCancelled()) {
+        conn->Close();
+        return usage;
+    }
+    if (r.ec)
+        ThrowTransportError(req, phase, r.ec);
+
+    auto& res = parser->get();
+    bool ok = res.result() == http::status::ok;
+    {
+        std::ostringstream head;
+        head << res.base();
+        RecordFlight(req, FlightEvent::ResponseHead, res.result_int(), head.str());
+    }
+    std::chrono::milliseconds retryAfter{-1};
+    auto retryAfterHeader = res[http::field::retry_after];
+    if (!retryAfterHeader.empty() && std::isdigit((unsigned char)retryAfterHeader[0]))
+        retryAfter = std::chrono::seconds(std::atol(std::string(retryAfterHeader).c_str()));
+    netClient.limiter.Observe(apiKey, route.model, res.result_int(), res.base(), retryAfter);
+    bool eventStream = res[http::field::content_type].find("text/event-stream") != beast::string_view::npos;
+    std::optional<GzipDecoder> gzip;
+    if (beast::iequals(res[http::field::content_encoding], "gzip"))
+        gzip.emplace();
+    std::string raw;
+    SseParser sse;
+    char chunk[8192];
+    bool bodyRecorded = false;
+    bool firstToken = true;
+
+    auto consume = [&](const char* data, std::size_t size) {
+        if (!bodyRecorded && size > 0) {
+            RecordFlight(req, FlightEvent::BodyHead, 0, std::string_view(data, size));
+            bodyRecorded = true;
+        }
+        if (!ok || !eventStream) {
+            // Errors and non-streamed replies (some providers ignore
+            // "stream") arrive as one JSON document.
+            raw.append(data, size);
+            return;
+        }
+        sse.Feed(data, size, [&](std::string_view payload) {
+            if (payload == "[DONE]")
+                return;
+            // Sharing the scratch resource makes the assignment below a move
+            // rather than a copy into the default heap resource.
+            JsonScratch& scratch = LocalJsonScratch();
+            json::value jv(json::storage_ptr(&scratch.resource));
+            const json::value* content = nullptr;
+            auto parseStart = std::chrono::steady_clock::now();
+            try {
+                TraceSpan span("parse event", "json");
+                jv = scratch.Parse(payload);
+                if (!jv.as_object().contains("error")) {
+                    if (auto* u = jv.as_object().if_contains("usage"))
+                        usage = ParseUsage(*u);
+                    auto& choices = jv.at("choices").as_array();
+                    auto* delta = choices.empty() ? nullptr : choices[0].as_object().if_contains("delta");
+                    if (delta && delta->is_object())
+                        content = delta->as_object().if_contains("content");
+                }
+                req.AddCost(0, std::chrono::duration_cast<std::chrono::microseconds>(
+                                   std::chrono::steady_clock::now() - parseStart).count());
+            } catch (const std::exception& e) {
+                RecordFlight(req, FlightEvent::ParseError, 0, std::string(e.what()) + ": " + std::string(payload));
+                throw;
+            }
+            if (jv.as_object().contains("error")) {
+                RecordFlight(req, FlightEvent::StreamError, 0, payload);
+                throw std::runtime_error(ExtractErrorMessage(json::serialize(jv)));
+            }
+            if (content && content->is_string() && !content->as_string().empty()) {
+                if (firstToken) {
+                    firstToken = false;
+                    RecordFlight(req, FlightEvent::FirstToken,
+                                 (std::int32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     std::chrono::steady_clock::now() - attemptStart).count());
+                }
+                if (!onText(json::value_to<std::string>(*content)))
+                    req.cancelled = true;
+            }
+        });
+    };
+
+    while (!parser->is_done()) {
+        res.body().data = chunk;
+        res.body().size = sizeof(chunk);
+        {
+            TraceSpan span("read", "net");
+            r = RunStreamOp(*conn, req, netClient.timeouts.readIdle, [&](auto done) {
+                conn->Use([&](auto& stream) { http::async_read_some(stream, conn->buffer, *parser, done); });
+            });
+        }
+        req.AddBytes(0, r.bytes);
+        if (r.ec == http::error::need_buffer)
+            r.ec = {};
+        if (req.IsCancelled()) {
+            conn->Close();
+            return usage;
+        }
+        if (r.ec)
+            ThrowTransportError(req, "read", r.ec);
+
+        std::size_t n = sizeof(chunk) - res.body().size;
+        if (gzip)
+            gzip->Feed(chunk, n, consume);
+        else
+            consume(chunk, n);
+    }
+
+    if (!ok) {
+        int status = res.result_int();
+        RecordFlight(req, FlightEvent::HttpError, status, raw);
+        bool retryable = status == 408 || status == 429 || status >= 500;
+        RequestError error("HTTP " + std::to_string(status) + ": " + ExtractErrorMessage(raw),
+                           status, retryable);
+        error.retryAfter = retryAfter;
+        if (parser->keep_alive())
+            netClient.pool.Release(std::move(conn));
+        throw error;
+    }
+    if (!eventStream) {
+        std::string text;
+        auto parseStart = std::chrono::steady_clock::now();
+        try {
+            TraceSpan span("parse reply", "json");
+            json::value jv = LocalJsonScratch().Parse(raw);
+            if (auto* u = jv.as_object().if_contains("usage"))
+                usage = ParseUsage(*u);
+            text = json::value_to<std::string>(jv.at("choices").at(0).at("message").at("content"));
+            req.AddCost(0, std::chrono::duration_cast<std::chrono::microseconds>(
+                               std::chrono::steady_clock::now() - parseStart).count());
+        } catch (const std::exception& e) {
+            RecordFlight(req, FlightEvent::ParseError, 0, std::string(e.what()) + ": " + raw);
+            throw;
+        }
+        onText(text);
+    }
+
+    if (parser->keep_alive() && !req.IsCancelled())
+        netClient.pool.Release(std::move(conn));
+    else
+        conn->Close();
+    return usage;
+}
+
+// Sends one non-streamed JSON request and returns the reply body, over a
+// pooled connection like a chat request. Used for the embeddings API.
+std::string PostJson(NetClient& netClient, RequestHandle& req, const Route& route, std::string body,
+                     const std::string& apiKey) {
+    TraceSpan span("post", "net");
+    http::request<http::string_body> httpReq{http::verb::post, route.target, 11};
+    httpReq.set(http::field::host, route.host);
+    httpReq.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+    httpReq.set(http::field::content_type, "application/json");
+    httpReq.set(http::field::authorization, "Bearer " + apiKey);
+    httpReq.keep_alive(true);
+    httpReq.body() = std::move(body);
+    httpReq.prepare_payload();
+    RecordFlight(req, FlightEvent::RequestStart, (std::int32_t)httpReq.body().size(),
+                 route.model + " " + route.host + ":" + route.port + route.target);
+
+    std::unique_ptr<Connection> conn = AcquireConnection(netClient, req, route);
+    std::optional<http::response_parser<http::string_body>> parser;
+    const char* phase = "write";
+    auto exchange = [&] {
+        parser.emplace();
+        parser->body_limit(std::numeric_limits<std::uint64_t>::max());
+        phase = "write";
+        OpResult r = RunStreamOp(*conn, req, netClient.timeouts.write, [&](auto done) {
+            conn->Use([&](auto& stream) { http::async_write(stream, httpReq, done); });
+        });
+        req.AddBytes(r.bytes, 0);
+        if (r.ec)
+            return r;
+        phase = "read";
+        r = RunStreamOp(*conn, req, netClient.timeouts.firstByte, [&](auto done) {
+            conn->Use([&](auto& stream) { http::async_read(stream, conn->buffer, *parser, done); });
+        });
+        req.AddBytes(0, r.bytes);
+        return r;
+    };
+    OpResult r = ExchangeWithRetry(netClient, req, route, conn, exchange);
+    if (r.ec) {
+        conn->Close();
+        ThrowTransportError(req, phase, r.ec);
+    }
+    auto& res = parser->get();
+    RecordFlight(req, FlightEvent::ResponseHead, res.result_int(), std::string_view(res.body()).substr(0, 256));
+    if (parser->keep_alive())
+        netClient.pool.Release(std::move(conn));
+    else
+        conn->Close();
+    if (res.result() != http::status::ok) {
+        int status = res.result_int();
+        throw RequestError("HTTP " + std::to_string(status) + ": " + ExtractErrorMessage(res.body()), status,
+                           status == 408 || status == 429 || status >= 500);
+    }
+    return std::move(res.body());
+}
+
+// Full-jitter exponential backoff: uniform in [0, min(max, base * 2^n)].
+std::chrono::milliseconds BackoffDelay(const RetryPolicy& policy, int attempt) {
+    static thread_local std::mt19937 rng{std::random_device{}()};
+    long long cap = policy.baseDelay.count() << std::min(attempt - 1, 16);
+    cap = std::min<long long>(cap, policy.maxDelay.count());
+    return std::chrono::milliseconds(std::uniform_int_distribution<long long>(0, cap)(rng));
+}
+
+// Sleeps in small slices so Stop still lands within a frame. Returns false
+// if the request was cancelled meanwhile.
+bool SleepUnlessCancelled(const RequestHandle& req, std::chrono::milliseconds delay) {
+    auto until = std::chrono::steady_clock::now() + delay;
+    while (std::chrono::steady_clock::now() < until) {
+        if (req.IsCancelled())
+            return false;
+        std::this_thread::sleep_for(kCancelPollInterval);
+    }
+    return !req.IsCancelled();
+}
+
+// Waits in the rate limiter's queue until one of `apiKeys` may send to
+// `model`. Returns the key to use, or an empty string if the request was
+// cancelled while queued.
+std::string AcquireRateSlot(NetClient& netClient, const std::string& apiKeys,
+                            const std::string& model, const RequestHandle& req) {
+    std::vector<std::string> keys = SplitApiKeys(apiKeys);
+    if (keys.empty())
+        return "";
+    RateLimiter::Reservation slot = netClient.limiter.Reserve(keys, model);
+    if (slot.wait.count() <= 0)
+        return slot.key;
+    netClient.limiter.queued++;
+    bool ready = SleepUnlessCancelled(req, slot.wait);
+    netClient.limiter.queued--;
+    if (!ready) {
+        netClient.limiter.Release(slot, model);
+        return "";
+    }
+    return slot.key;
+}
+
+struct ChatResult {
+    int route = -1;
+    Usage usage;
+    std::chrono::steady_clock::time_point firstToken; // unset if no text arrived
+};
+
+// Races up to two attempts of the same request. The first goes to
+// `fixedRoute`, or the router's pick when that is -1. If hedging is enabled
+// and it has not produced a first token by the p95 TTFT, a duplicate goes
+// out on a second connection, to the next best route unless the route is
+// fixed. Whichever streams first wins and the other is cancelled. Both feed
+// the router's statistics. `gotText` reports whether any text reached
+// `onText`, which rules out retrying.
+template <class BodyFor, class OnText>
+ChatResult RunHedgedAttempt(NetClient& netClient, Router& router,
+                            const std::shared_ptr<RequestHandle>& req, BodyFor&& bodyFor,
+                            const std::string& apiKey, OnText&& onText, int fixedRoute,
+                            bool& gotText, int& routeTried) {
+    struct Race {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::shared_ptr<RequestHandle> attempts[2];
+        std::exception_ptr errors[2];
+        int routes[2] = {-1, -1};
+        Usage usage[2];
+        int launched = 0;
+        int finished = 0;
+        int winner = -1;
+        std::chrono::steady_clock::time_point firstToken;
+    } race;
+    std::thread threads[2];
+    auto started = std::chrono::steady_clock::now();
+    int primary = fixedRoute >= 0 ? fixedRoute : router.Pick();
+    routeTried = primary;
+
+    // Called with race.mutex held.
+    auto launch = [&](int i, int routeIndex) {
+        race.attempts[i] = std::make_shared<RequestHandle>();
+        race.attempts[i]->parent = req;
+        race.routes[i] = routeIndex;
+        race.launched++;
+        threads[i] = std::thread([&, i, routeIndex, attempt = race.attempts[i]] {
+            MemTagScope tag(MemTag::Network);
+            std::uint64_t allocationsBefore = g_threadHeapAllocations;
+            Route route = router.Get(routeIndex);
+            auto attemptStart = std::chrono::steady_clock::now();
+            std::chrono::steady_clock::time_point firstToken;
+            int tokens = 0;
+            Usage usage;
+            std::exception_ptr error;
+            try {
+                std::string key;
+                {
+                    TraceSpan span("rate limit wait", "net");
+                    key = AcquireRateSlot(netClient, apiKey, route.model, *attempt);
+                }
+                if (key.empty())
+                    throw RequestError(attempt->IsCancelled() ? "Cancelled" : "No API key", 0, false);
+                auto bodyStart = std::chrono::steady_clock::now();
+                auto body = bodyFor(route);
+                attempt->AddCost(0, std::chrono::duration_cast<std::chrono::microseconds>(
+                                        std::chrono::steady_clock::now() - bodyStart).count());
+                usage = StreamChatCompletion(netClient, *attempt, route, std::move(body), key,
+                    [&](const std::string& text) {
+                        {
+                            std::lock_guard<std::mutex> lock(race.mutex);
+                            if (race.winner == -1) {
+                                race.winner = i;
+                                firstToken = std::chrono::steady_clock::now();
+                                race.firstToken = firstToken;
+                                double ms = std::chrono::duration<double, std::milli>(
+                                    firstToken - started).count();
+                                netClient.ttft.Add(ms);
+                                (attempt->warmConnection ? netClient.ttftWarm
+                                                         : netClient.ttftCold).Add(ms);
+                                if (race.attempts[1 - i])
+                                    race.attempts[1 - i]->cancelled = true;
+                                race.cv.notify_all();
+                            } else if (race.winner != i) {
+                                return false;
+                            }
+                        }
+                        tokens++;
+                        return onText(route, text);
+                    });
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            if (error && !attempt->IsCancelled()) {
+                router.RecordFailure(routeIndex);
+            } else if (!error && tokens > 0 && !attempt->IsCancelled()) {
+                auto end = std::chrono::steady_clock::now();
+                if (usage.completionTokens > 0)
+                    tokens = usage.completionTokens;
+                double ttftMs = std::chrono::duration<double, std::milli>(firstToken - attemptStart).count();
+                double streamSec = std::chrono::duration<double>(end - firstToken).count();
+                router.RecordSuccess(routeIndex, ttftMs, streamSec > 0.0 ? tokens / streamSec : 0.0);
+                netClient.promptCache.Record(usage, ttftMs);
+            }
+            attempt->AddCost(g_threadHeapAllocations - allocationsBefore, 0);
+
+            std::lock_guard<std::mutex> lock(race.mutex);
+            race.errors[i] = error;
+            race.usage[i] = usage;
+            race.finished++;
+            race.cv.notify_all();
+        });
+    };
+
+    {
+        std::unique_lock<std::mutex> lock(race.mutex);
+        launch(0, primary);
+        if (netClient.hedging) {
+            auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::duration<double, std::milli>(netClient.ttft.Percentile(0.95)));
+            if (netClient.ttft.Count() < kMinHedgeSamples)
+                delay = kDefaultHedgeDelay;
+            delay = std::max(delay, kMinHedgeDelay);
+            race.cv.wait_until(lock, started + delay,
+                               [&] { return race.winner != -1 || race.finished > 0; });
+            if (race.winner == -1 && race.finished == 0 && !req->IsCancelled())
+                launch(1, fixedRoute >= 0 ? fixedRoute : router.Pick(primary));
+        }
+        race.cv.wait(lock, [&] { return race.finished == race.launched; });
+    }
+    for (auto& t : threads)
+        if (t.joinable())
+            t.join();
+
+    gotText = race.winner != -1;
+    if (gotText) {
+        if (race.errors[race.winner])
+            std::rethrow_exception(race.errors[race.winner]);
+        return {race.routes[race.winner], race.usage[race.winner], race.firstToken};
+    }
+    for (auto& error : race.errors)
+        if (error)
+            std::rethrow_exception(error);
+    // No attempt produced text (cancelled, or an empty reply).
+    return {primary, race.usage[0], std::chrono::steady_clock::time_point{}};
 }
 
-void RenderHighlightedCode(const std::string& code, const std::string& lang) {
-    auto rules = GetRulesForLanguage(lang);
-    
-    std::vector<std::string> lines;
-    std::stringstream ss(code);
-    std::string line;
-    while (std::getline(ss, line)) {
-        lines.push_back(line);
+// Sends a request with retries. Retryable failures before the first token
+// back off with full jitter, or wait out the server's Retry-After. Unless
+// the route is fixed, each retry asks the router again, so a failing route
+// is usually left behind.
+template <class BodyFor, class OnText>
+ChatResult SendChatRequest(NetClient& netClient, Router& router,
+                           const std::shared_ptr<RequestHandle>& req, BodyFor&& bodyFor,
+                           const std::string& apiKey, OnText&& onText, int fixedRoute = -1) {
+    auto started = std::chrono::steady_clock::now();
+    LedgerEntry entry;
+    entry.timeMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    int routeTried = -1;
+    netClient.metrics.Local().inFlight.fetch_add(1, std::memory_order_relaxed);
+    auto record = [&](const ChatResult& result, const char* status, int attempt) {
+        int route = result.route >= 0 ? result.route : routeTried;
+        if (route >= 0)
+            entry.route = router.Get(route).name;
+        entry.status = req->IsCancelled() ? "cancelled" : status;
+        entry.promptTokens = result.usage.promptTokens;
+        entry.completionTokens = result.usage.completionTokens;
+        entry.cachedTokens = result.usage.cachedTokens;
+        auto end = std::chrono::steady_clock::now();
+        entry.totalMs = std::chrono::duration<float, std::milli>(end - started).count();
+        if (result.firstToken != std::chrono::steady_clock::time_point{}) {
+            entry.ttftMs = std::chrono::duration<float, std::milli>(result.firstToken - started).count();
+            float streamSec = std::chrono::duration<float>(end - result.firstToken).count();
+            if (streamSec > 0.0f && result.usage.completionTokens > 0)
+                entry.tokensPerSec = result.usage.completionTokens / streamSec;
+        }
+        entry.bytesSent = req->bytesSent;
+        entry.bytesReceived = req->bytesReceived;
+        entry.heapAllocations = req->heapAllocations;
+        entry.jsonMs = req->jsonMicros / 1000.0f;
+        entry.retries = attempt - 1;
+        netClient.ledger.Add(entry);
+        RecordFlight(*req, FlightEvent::RequestEnd, (std::int32_t)entry.totalMs,
+                     entry.status + " " + entry.route);
+
+        MetricsShard& metrics = netClient.metrics.Local();
+        metrics.inFlight.fetch_sub(1, std::memory_order_relaxed);
+        metrics.retries.fetch_add(entry.retries, std::memory_order_relaxed);
+        if (route >= 0) {
+            size_t slot = MetricRoute(route);
+            int statusIndex = entry.status == "ok" ? 0 : entry.status == "error" ? 1 : 2;
+            metrics.requests[slot][statusIndex].fetch_add(1, std::memory_order_relaxed);
+            metrics.latency[slot].Observe(kLatencyBuckets, entry.totalMs / 1000.0);
+            if (entry.ttftMs >= 0.0f)
+                metrics.ttft[slot].Observe(kTtftBuckets, entry.ttftMs / 1000.0);
+        }
+    };
+
+    for (int attempt = 1;; attempt++) {
+        bool gotText = false;
+        std::chrono::milliseconds delay;
+        try {
+            ChatResult result = RunHedgedAttempt(netClient, router, req, bodyFor, apiKey, onText,
+                                                 fixedRoute, gotText, routeTried);
+            record(result, "ok", attempt);
+            return result;
+        } catch (const RequestError& e) {
+            if (!e.retryable || gotText || attempt >= netClient.retry.maxAttempts) {
+                record({}, "error", attempt);
+                throw;
+            }
+            delay = e.retryAfter.count() >= 0 ? e.retryAfter : BackoffDelay(netClient.retry, attempt);
+        } catch (...) {
+            record({}, "error", attempt);
+            throw;
+        }
+        TraceSpan span("backoff", "net");
+        RecordFlight(*req, FlightEvent::Backoff, (std::int32_t)delay.count());
+        if (!SleepUnlessCancelled(*req, delay)) {
+            record({}, "cancelled", attempt);
+            return {};
+        }
     }
-    
-    for (const auto& codeLine : lines) {
-        if (codeLine.empty()) {
-            ImGui::Text("");
+}
+
+ChatBody BuildChatBody(const MessageFragments& messages, const Route& route) {
+    MemTagScope tag(MemTag::Json);
+    ChatBody body;
+    body.head = "{\"model\":";
+    AppendJsonString(body.head, route.model);
+    body.head += ",\"messages\":[";
+    body.messages = messages;
+    body.tail = "],\"stream\":true,\"stream_options\":{\"include_usage\":true}}";
+    return body;
+}
+
+// Hands a cached reply to `onText` in word-sized pieces, the way a live
+// stream would arrive, without waiting between them.
+template <class OnText>
+void ReplayAsStream(const std::string& text, OnText&& onText) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find_first_of(" \n", pos);
+        end = end == std::string::npos ? text.size() : text.find_first_not_of(" \n", end);
+        if (end == std::string::npos)
+            end = text.size();
+        if (!onText(text.substr(pos, end - pos)))
+            return;
+        pos = end;
+    }
+}
+
+// Embeds `texts`, unit length, with the embeddings API if one is configured
+// and the hashed stand-in otherwise.
+std::vector<std::vector<float>> EmbedTexts(NetClient& net, RequestHandle& req, const std::optional<Route>& endpoint,
+                                           const std::string& apiKey, const std::vector<std::string>& texts) {
+    TraceSpan span("embed", "recall");
+    std::vector<std::vector<float>> vectors;
+    if (!endpoint) {
+        for (const std::string& text : texts)
+            vectors.push_back(HashEmbedding(text));
+        return vectors;
+    }
+    std::string body = "{\"model\":";
+    AppendJsonString(body, endpoint->model);
+    body += ",\"input\":[";
+    for (size_t i = 0; i < texts.size(); i++) {
+        if (i > 0)
+            body += ',';
+        AppendJsonString(body, texts[i]);
+    }
+    body += "]}";
+    std::string reply = PostJson(net, req, *endpoint, std::move(body), apiKey);
+    json::value jv = LocalJsonScratch().Parse(reply);
+    vectors.resize(texts.size());
+    for (const json::value& item : jv.at("data").as_array()) {
+        const json::object& obj = item.as_object();
+        size_t i = obj.contains("index") ? (size_t)obj.at("index").to_number<std::int64_t>() : 0;
+        if (i >= vectors.size())
             continue;
+        std::vector<float>& v = vectors[i];
+        float norm = 0.0f;
+        for (const json::value& x : obj.at("embedding").as_array()) {
+            v.push_back(x.to_number<float>());
+            norm += v.back() * v.back();
         }
-        
-        std::vector<Highlight> highlights;
-        
-        for (const auto& rule : rules) {
-            auto begin = std::sregex_iterator(codeLine.begin(), codeLine.end(), rule.pattern);
-            auto end = std::sregex_iterator();
-            
-            for (auto it = begin; it != end; ++it) {
-                Highlight h;
-                h.start = it->position();
-                h.end = it->position() + it->length();
-                h.color = rule.color;
-                highlights.push_back(h);
+        if (norm > 0.0f)
+            for (float& x : v)
+                x /= std::sqrt(norm);
+    }
+    return vectors;
+}
+
+// Embeds queued messages in batches until the app exits. Messages whose
+// text is already in the index, from this session or an earlier one, only
+// get their row looked up.
+void RunRecallWorker(AppContext* ctx) {
+    MemTagScope tag(MemTag::Recall);
+    RecallIndex& recall = ctx->recall;
+    std::optional<Route> endpoint;
+    {
+        std::lock_guard<std::mutex> lock(ctx->router.mutex);
+        endpoint = ctx->router.embeddings;
+    }
+    std::unique_lock<std::mutex> lock(recall.mutex);
+    recall.Load(endpoint);
+    while (true) {
+        recall.wake.wait(lock, [&] {
+            return recall.stopping || (!recall.pending.empty() && (!endpoint || !recall.apiKey.empty()));
+        });
+        if (recall.stopping)
+            return;
+        std::vector<const MessageNode*> batch;
+        while (!recall.pending.empty() && batch.size() < kEmbedBatch) {
+            const MessageNode* node = recall.pending.front();
+            recall.pending.pop_front();
+            if (recall.RowOf(*node) < 0)
+                batch.push_back(node);
+        }
+        std::string apiKey = recall.apiKey;
+        lock.unlock();
+
+        std::vector<std::string> texts;
+        {
+            auto historyLock = TraceLock(ctx->historyMutex, "wait history");
+            for (const MessageNode* node : batch)
+                texts.emplace_back(node->message.content.View().substr(0, kMaxEmbedBytes));
+        }
+        std::vector<std::uint64_t> hashes;
+        std::vector<std::uint64_t> missingHashes;
+        std::vector<std::string> missing;
+        lock.lock();
+        for (const std::string& text : texts) {
+            hashes.push_back(EmbeddingIndex::Hash(text));
+            if (recall.index.Find(hashes.back()) < 0 &&
+                std::find(missingHashes.begin(), missingHashes.end(), hashes.back()) == missingHashes.end()) {
+                missingHashes.push_back(hashes.back());
+                missing.push_back(text);
             }
         }
-        
-        std::sort(highlights.begin(), highlights.end());
-        
-        std::vector<Highlight> filtered;
-        int lastEnd = 0;
-        for (const auto& h : highlights) {
-            if (h.start >= lastEnd) {
-                filtered.push_back(h);
-                lastEnd = h.end;
+        lock.unlock();
+
+        std::vector<std::vector<float>> vectors;
+        std::string error;
+        if (!missing.empty()) {
+            try {
+                vectors = EmbedTexts(ctx->net, recall.handle, endpoint, apiKey, missing);
+            } catch (const std::exception& e) {
+                error = e.what();
             }
         }
-        
-        int pos = 0;
-        for (const auto& h : filtered) {
-            if (h.start > pos) {
-                ImGui::SameLine(0, 0);
-                std::string segment = codeLine.substr(pos, h.start - pos);
-                ImGui::Text("%s", segment.c_str());
-            }
-            
-            ImGui::SameLine(0, 0);
-            ImGui::PushStyleColor(ImGuiCol_Text, h.color);
-            std::string segment = codeLine.substr(h.start, h.end - h.start);
-            ImGui::Text("%s", segment.c_str());
-            ImGui::PopStyleColor();
-            
-            pos = h.end;
+
+        lock.lock();
+        recall.lastError = error;
+        for (size_t i = 0; i < vectors.size(); i++)
+            recall.index.Add(missingHashes[i], vectors[i]);
+        for (size_t i = 0; i < batch.size(); i++)
+            recall.SetRow(*batch[i], recall.index.Find(hashes[i]));
+        recall.index.Save();
+        if (!error.empty()) {
+            // Back off before trying the next batch; these messages stay
+            // unembedded until they are queued again.
+            recall.wake.wait_for(lock, std::chrono::seconds(10), [&] { return recall.stopping; });
         }
-        
-        if (pos < (int)codeLine.length()) {
-            ImGui::SameLine(0, 0);
-            std::string segment = codeLine.substr(pos);
-            ImGui::Text("%s", segment.c_str());
+    }
+}
+
+// Older messages on `path`, before `start`, most similar to its newest one,
+// oldest first and within kRecallByteBudget. Called without locks held.
+std::vector<const MessageNode*> Recall(AppContext* ctx, const std::shared_ptr<RequestHandle>& req,
+                                       const std::vector<const MessageNode*>& path, size_t start,
+                                       const std::string& apiKey) {
+    TraceSpan span("recall", "recall");
+    MemTagScope tag(MemTag::Recall);
+    RecallIndex& recall = ctx->recall;
+    std::vector<const MessageNode*> chosen;
+    if (path.empty() || start == 0)
+        return chosen;
+    std::optional<Route> endpoint;
+    {
+        std::lock_guard<std::mutex> lock(ctx->router.mutex);
+        endpoint = ctx->router.embeddings;
+    }
+    std::string query;
+    {
+        auto lock = TraceLock(ctx->historyMutex, "wait history");
+        query = std::string(path.back()->message.content.View().substr(0, kMaxEmbedBytes));
+    }
+
+    // The prompt itself is usually still queued; embed it here rather than
+    // wait for the worker, under the request's Stop button and a deadline.
+    std::uint64_t hash = EmbeddingIndex::Hash(query);
+    std::vector<std::int8_t> q;
+    float queryScale = 0.0f;
+    {
+        std::lock_guard<std::mutex> lock(recall.mutex);
+        recall.Load(endpoint);
+        recall.apiKey = apiKey;
+        recall.wake.notify_one();
+        if (int row = recall.index.Find(hash); row >= 0) {
+            q.assign(recall.index.values.begin() + (size_t)row * recall.index.dim,
+                     recall.index.values.begin() + (size_t)(row + 1) * recall.index.dim);
+            queryScale = recall.index.scales[row];
         }
-        
-        if (pos == 0 && filtered.empty()) {
-            ImGui::Text("%s", codeLine.c_str());
+    }
+    if (q.empty()) {
+        RequestHandle handle;
+        handle.parent = req;
+        handle.deadline = std::chrono::steady_clock::now() + kRecallEmbedTimeout;
+        std::vector<float> v = EmbedTexts(ctx->net, handle, endpoint, apiKey, {query}).at(0);
+        std::lock_guard<std::mutex> lock(recall.mutex);
+        int row = recall.index.Add(hash, v);
+        if (row < 0)
+            return chosen;
+        q.assign(recall.index.values.begin() + (size_t)row * recall.index.dim,
+                 recall.index.values.begin() + (size_t)(row + 1) * recall.index.dim);
+        queryScale = recall.index.scales[row];
+    }
+
+    std::vector<std::pair<float, const MessageNode*>> scored;
+    {
+        std::lock_guard<std::mutex> lock(recall.mutex);
+        for (size_t i = 0; i < start; i++) {
+            int row = recall.RowOf(*path[i]);
+            if (row < 0)
+                continue;
+            float score = recall.index.Score(row, q.data(), queryScale);
+            if (score >= kRecallMinScore)
+                scored.push_back({score, path[i]});
+        }
+    }
+    std::sort(scored.begin(), scored.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+    {
+        auto lock = TraceLock(ctx->historyMutex, "wait history");
+        size_t bytes = 0;
+        for (const auto& [score, node] : scored) {
+            if (chosen.size() == kRecallMaxMessages)
+                break;
+            size_t size = node->message.content.View().size();
+            if (bytes + size > kRecallByteBudget)
+                continue;
+            bytes += size;
+            chosen.push_back(node);
+        }
+    }
+    std::sort(chosen.begin(), chosen.end(), [](const MessageNode* a, const MessageNode* b) { return a->depth < b->depth; });
+    recall.recalled += (unsigned)chosen.size();
+    return chosen;
+}
+
+void DesktopAPICall(AppContext* ctx, std::shared_ptr<RequestHandle> req, std::string apiKey) {
+    MemTagScope tag(MemTag::Network);
+    TraceSpan span("request", "net");
+    try {
+        // `breakpoints` is the same conversation with cache_control marks
+        // after the system prompt and after the turns before the newest.
+        MessageFragments messages;
+        MessageFragments breakpoints;
+        std::vector<const MessageNode*> path;
+        size_t start = 0;
+        {
+            // The branch the prompt was sent on, even if the UI has since
+            // switched to another.
+            auto lock = TraceLock(ctx->historyMutex, "wait history");
+            MessageNode* prompt = req->anchor ? req->anchor : ctx->history.Leaf();
+            path = ctx->history.PathTo(prompt);
+            size_t count = path.size();
+            // Each branch keeps its own window, from its latest sent prompt.
+            for (size_t i = count; i-- > 0;) {
+                if (path[i]->contextStart >= 0) {
+                    start = (size_t)path[i]->contextStart;
+                    break;
+                }
+            }
+            if (start > count || count - start > kContextMaxMessages)
+                start = count > kContextMinMessages ? count - kContextMinMessages : 0;
+            prompt->contextStart = (std::int32_t)start;
+            messages.push_back(SystemPromptFragment());
+            for (size_t i = start; i < count; i++)
+                messages.push_back(FragmentFor(path[i]->message));
+
+            breakpoints = messages;
+            breakpoints[0] = SystemPromptBreakpoint();
+            if (count - start >= 2)
+                breakpoints[breakpoints.size() - 2] = BreakpointFragmentFor(path[count - 2]->message);
+        }
+
+        // Older messages resembling the prompt go just before it, so the
+        // prefix up to the previous turn stays the same for prompt caches.
+        std::vector<std::string> keys = SplitApiKeys(apiKey);
+        if (ctx->recall.enabled && start > 0 && start < path.size() && !keys.empty()) {
+            try {
+                std::vector<const MessageNode*> recalled = Recall(ctx, req, path, start, keys.front());
+                if (!recalled.empty()) {
+                    std::string text = "Earlier in this conversation:";
+                    {
+                        auto lock = TraceLock(ctx->historyMutex, "wait history");
+                        for (const MessageNode* node : recalled) {
+                            text += "\n\n";
+                            text += node->message.role;
+                            text += ": ";
+                            text += node->message.content.View();
+                        }
+                    }
+                    auto fragment = MessageFragment("system", text);
+                    messages.insert(messages.end() - 1, fragment);
+                    breakpoints.insert(breakpoints.end() - 1, fragment);
+                }
+            } catch (const std::exception& e) {
+                // Best effort: the request goes out with the recent window.
+                std::lock_guard<std::mutex> lock(ctx->recall.mutex);
+                ctx->recall.lastError = e.what();
+            }
+        }
+
+        ResponseCache& cache = ctx->net.cache;
+        if (cache.enabled) {
+            // Any candidate route's answer will do, the pinned one if set.
+            std::vector<Route> candidates;
+            {
+                std::lock_guard<std::mutex> lock(ctx->router.mutex);
+                if (ctx->router.pinned >= 0)
+                    candidates.push_back(ctx->router.routes[ctx->router.pinned]);
+                else
+                    candidates = ctx->router.routes;
+            }
+            MetricsShard& metrics = ctx->net.metrics.Local();
+            for (const Route& route : candidates) {
+                if (req->bypassCache)
+                    break;
+                if (auto hit = cache.Get(ResponseCache::Key(route, messages))) {
+                    metrics.cacheHits.fetch_add(1, std::memory_order_relaxed);
+                    ReplayAsStream(hit->text, [&](const std::string& text) {
+                        return ctx->AppendReply(*req, text, hit->route, true);
+                    });
+                    ctx->FinishRequest(req);
+                    return;
+                }
+            }
+            metrics.cacheMisses.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        auto bodyFor = [&](const Route& route) {
+            return BuildChatBody(route.cacheControl ? breakpoints : messages, route);
+        };
+        ChatResult result = SendChatRequest(ctx->net, ctx->router, req, bodyFor, apiKey,
+                        [&](const Route& route, const std::string& text) {
+                            return ctx->AppendReply(*req, text, route.name);
+                        });
+
+        if (cache.enabled && !req->IsCancelled() && result.route >= 0) {
+            // The reply is read back from history rather than kept in a
+            // second buffer while it streams; the copy is made unlocked.
+            MessageText::Snapshot reply;
+            {
+                auto lock = TraceLock(ctx->historyMutex, "wait history");
+                if (req->reply)
+                    reply = req->reply->message.content.Share();
+            }
+            Route route = ctx->router.Get(result.route);
+            if (!reply.chunks.empty())
+                cache.Put(ResponseCache::Key(route, messages), {route.name, reply.ToString(), result.usage});
+        }
+    } catch (std::exception const &e) {
+        ctx->FailRequest(*req, std::string("Error: ") + e.what());
+    }
+    ctx->FinishRequest(req);
+}
+
+// Turning recall on queues every message, on every branch, for embedding;
+// turning it off drops the queue but keeps the index.
+void SetRecall(AppContext* ctx, bool enabled) {
+    auto lock = TraceLock(ctx->historyMutex, "wait history");
+    ctx->recall.enabled = enabled;
+    if (enabled) {
+        ctx->history.ForEachNode([&](const MessageNode& node) { ctx->recall.Enqueue(ctx, node); });
+    } else {
+        std::lock_guard<std::mutex> recallLock(ctx->recall.mutex);
+        ctx->recall.pending.clear();
+    }
+}
+
+// Resolves, connects and handshakes with the endpoints the next request is
+// likely to use, so SEND finds a warm connection in the pool. Called from
+// the UI thread on input focus, keystrokes and API key entry; unused
+// connections expire like any other idle one.
+void Prewarm(AppContext* ctx) {
+    NetClient& net = ctx->net;
+    auto now = std::chrono::steady_clock::now();
+    if (!net.prewarm || ctx->isWaiting || now - net.lastPrewarm < kPrewarmInterval)
+        return;
+    if (net.prewarming.exchange(true))
+        return;
+    net.lastPrewarm = now;
+
+    std::vector<std::pair<std::string, std::string>> endpoints;
+    {
+        std::lock_guard<std::mutex> lock(ctx->router.mutex);
+        Router& router = ctx->router;
+        for (int i = 0; i < (int)router.routes.size(); i++) {
+            // Plain routes lead to a local gateway; nothing to gain.
+            if ((router.pinned >= 0 && i != router.pinned) || !router.routes[i].tls)
+                continue;
+            std::pair<std::string, std::string> ep{router.routes[i].host, router.routes[i].port};
+            if (std::find(endpoints.begin(), endpoints.end(), ep) == endpoints.end() &&
+                endpoints.size() < kPoolMaxIdle)
+                endpoints.push_back(ep);
+        }
+    }
+
+    // The previous pre-warm has cleared `prewarming`, so it is finishing.
+    if (net.prewarmThread.joinable())
+        net.prewarmThread.join();
+    net.prewarmThread = std::thread([&net, endpoints] {
+        MemTagScope tag(MemTag::Network);
+        for (const auto& [host, port] : endpoints) {
+            if (net.pool.HasIdle(host, port) || net.prewarmHandle.IsCancelled())
+                continue;
+            try {
+                net.pool.Release(OpenConnection(net, host, port, net.prewarmHandle));
+            } catch (std::exception const&) {
+                // Speculative; the real request reports any error.
+            }
+        }
+        net.prewarming = false;
+    });
+}
+#endif
+
+#ifdef _WEB_BUILD
+void onFetchSuccess(emscripten_fetch_t *fetch) {
+    MemTagScope tag(MemTag::Network);
+    auto* req = static_cast<RequestHandle*>(fetch->userData);
+    Router& router = g_webContext->router;
+
+    // Parsed straight out of the fetch buffer, which is closed afterwards.
+    try {
+        json::value jv = LocalJsonScratch().Parse(std::string_view(fetch->data, fetch->numBytes));
+        std::string reply = json::value_to<std::string>(
+            jv.at("choices").at(0).at("message").at("content"));
+
+        // Without streaming the whole reply is the first token; tokens/s
+        // comes from usage when the provider reports it.
+        double elapsedMs = emscripten_get_now() - req->startMs;
+        double tokens = reply.size() / 4.0;
+        if (auto* u = jv.as_object().if_contains("usage")) {
+            Usage usage = ParseUsage(*u);
+            if (usage.completionTokens >= 0)
+                tokens = usage.completionTokens;
+        }
+        router.RecordSuccess(req->routeIndex, elapsedMs,
+                             elapsedMs > 0.0 ? tokens * 1000.0 / elapsedMs : 0.0);
+        g_webContext->AppendReply(*req, reply, router.Get(req->routeIndex).name);
+    } catch (...) {
+        router.RecordFailure(req->routeIndex);
+        g_webContext->FailRequest(*req, "Error parsing JSON response");
+    }
+    emscripten_fetch_close(fetch);
+    req->fetch = nullptr;
+    g_webContext->FinishRequest(g_webContext->activeRequest);
+}
+
+void onFetchError(emscripten_fetch_t *fetch) {
+    auto* req = static_cast<RequestHandle*>(fetch->userData);
+    emscripten_fetch_close(fetch);
+    req->fetch = nullptr;
+    g_webContext->router.RecordFailure(req->routeIndex);
+    g_webContext->FailRequest(*req, "Network Error (Check console)");
+    g_webContext->FinishRequest(g_webContext->activeRequest);
+}
+
+void WebAPICall(RequestHandle* req, std::string message, std::string apiKey) {
+    MemTagScope tag(MemTag::Network);
+    req->routeIndex = g_webContext->router.Pick();
+    Route route = g_webContext->router.Get(req->routeIndex);
+
+    std::string requestBody = "{\"model\":";
+    AppendJsonString(requestBody, route.model);
+    requestBody += ",\"messages\":[";
+    requestBody += *MessageFragment("user", message);
+    requestBody += "]}";
+
+    emscripten_fetch_attr_t attr;
+    emscripten_fetch_attr_init(&attr);
+    strcpy(attr.requestMethod, "POST");
+    attr.attributes = EMSCRIPTEN_FETCH_LOAD_TO_MEMORY;
+    attr.onsuccess = onFetchSuccess;
+    attr.onerror = onFetchError;
+    attr.userData = req;
+
+    static std::vector<const char *> headers;
+    headers.clear();
+    static std::string authHeader = "Bearer " + apiKey;
+    headers.push_back("Content-Type");
+    headers.push_back("application/json");
+    headers.push_back("Authorization");
+    headers.push_back(authHeader.c_str());
+    headers.push_back("HTTP-Referer");
+    headers.push_back("http://localhost:8000");
+    headers.push_back(NULL);
+
+    attr.requestHeaders = headers.data();
+    attr.requestData = requestBody.c_str();
+    attr.requestDataSize = requestBody.size();
+
+    std::string url = "https://" + route.host + route.target;
+    req->startMs = emscripten_get_now();
+    req->fetch = emscripten_fetch(&attr, url.c_str());
+}
+#endif
+
+// The reply goes under `anchor`, the prompt's node.
+void StartRequest(AppContext* ctx, [[maybe_unused]] std::string msg, std::string key, bool bypassCache,
+                  MessageNode* anchor) {
+    auto req = std::make_shared<RequestHandle>();
+    req->bypassCache = bypassCache;
+    req->anchor = anchor;
+    {
+        auto lock = TraceLock(ctx->historyMutex, "wait history");
+        ctx->activeRequest = req;
+        ctx->isWaiting = true;
+    }
+
+#ifdef _WEB_BUILD
+    WebAPICall(req.get(), msg, SplitApiKeys(key).front());
+#else
+    ctx->requestThreads++;
+    std::thread([ctx, req, key]() {
+        DesktopAPICall(ctx, req, key);
+        ctx->requestThreads--;
+    }).detach();
+#endif
+}
+
+void SendMessage(AppContext* ctx) {
+    std::string msg = ctx->inputBuffer;
+    std::string key = ctx->apiKeyBuffer;
+    if (msg.empty())
+        return;
+    if (SplitApiKeys(key).empty()) {
+        ctx->AddMessage("system", "Please enter API Key first.");
+        return;
+    }
+
+    // An edited prompt becomes a new branch beside the original.
+    MessageNode* parent = nullptr;
+    if (ctx->editing) {
+        parent = ctx->editing->parent;
+        ctx->editing = nullptr;
+    }
+    MessageNode* node = ctx->AddMessage("user", msg, parent);
+    memset(ctx->inputBuffer, 0, sizeof(ctx->inputBuffer));
+    StartRequest(ctx, msg, key, false, node);
+}
+
+// Asks again for the last reply, bypassing the response cache. The fresh
+// answer becomes a new branch beside the old one, and replaces it in the
+// cache.
+void RegenerateLast(AppContext* ctx) {
+    std::string key = ctx->apiKeyBuffer;
+    if (SplitApiKeys(key).empty()) {
+        ctx->AddMessage("system", "Please enter API Key first.");
+        return;
+    }
+
+    std::string msg;
+    MessageNode* prompt = nullptr;
+    {
+        auto lock = TraceLock(ctx->historyMutex, "wait history");
+        MessageNode* leaf = ctx->history.Leaf();
+        if (leaf->message.role != "assistant")
+            return;
+        for (prompt = leaf->parent; prompt && prompt->message.role != "user";)
+            prompt = prompt->parent;
+        if (!prompt)
+            return;
+        msg = std::string(prompt->message.content.View());
+    }
+    StartRequest(ctx, msg, key, true, prompt);
+}
+
+#ifndef _WEB_BUILD
+void RunCompareColumn(AppContext* ctx, std::shared_ptr<CompareSession> session, size_t index,
+                      std::string apiKey, MessageFragments messages) {
+    MemTagScope tag(MemTag::Network);
+    std::shared_ptr<RequestHandle> handle;
+    int route;
+    {
+        std::lock_guard<std::mutex> lock(session->mutex);
+        handle = session->columns[index].handle;
+        route = session->columns[index].route;
+    }
+    auto started = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point firstToken;
+    int chunks = 0;
+
+    try {
+        ChatResult result = SendChatRequest(ctx->net, ctx->router, handle,
+            [&](const Route& r) { return BuildChatBody(messages, r); }, apiKey,
+            [&](const Route&, const std::string& text) {
+                std::lock_guard<std::mutex> lock(session->mutex);
+                if (handle->IsCancelled())
+                    return false;
+                CompareColumn& col = session->columns[index];
+                if (col.ttftMs < 0.0) {
+                    firstToken = std::chrono::steady_clock::now();
+                    col.ttftMs = std::chrono::duration<double, std::milli>(firstToken - started).count();
+                }
+                col.text += text;
+                col.status = "streaming";
+                chunks++;
+                return true;
+            }, route);
+
+        std::lock_guard<std::mutex> lock(session->mutex);
+        CompareColumn& col = session->columns[index];
+        col.usage = result.usage;
+        if (handle->IsCancelled()) {
+            col.status = "cancelled";
+        } else {
+            double streamSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - firstToken).count();
+            int tokens = result.usage.completionTokens > 0 ? result.usage.completionTokens : chunks;
+            col.tokensPerSec = chunks > 0 && streamSec > 0.0 ? tokens / streamSec : 0.0;
+            col.status = "done";
+            if (session->firstCompleteWins && session->winner < 0) {
+                session->winner = (int)index;
+                for (auto& other : session->columns)
+                    if (other.handle != handle)
+                        other.handle->cancelled = true;
+            }
+        }
+    } catch (std::exception const &e) {
+        std::lock_guard<std::mutex> lock(session->mutex);
+        session->columns[index].status =
+            handle->IsCancelled() ? std::string("cancelled") : std::string("error: ") + e.what();
+    }
+    session->running--;
+}
+
+// Sends the input to every route ticked for comparison, all at once.
+void SendCompare(AppContext* ctx) {
+    std::string msg = ctx->inputBuffer;
+    std::string key = ctx->apiKeyBuffer;
+    if (msg.empty())
+        return;
+    if (SplitApiKeys(key).empty()) {
+        ctx->AddMessage("system", "Please enter API Key first.");
+        return;
+    }
+
+    auto session = std::make_shared<CompareSession>();
+    session->prompt = msg;
+    session->handle = std::make_shared<RequestHandle>();
+    session->firstCompleteWins = ctx->firstCompleteWins;
+    {
+        std::lock_guard<std::mutex> lock(ctx->router.mutex);
+        for (int i = 0; i < (int)ctx->router.routes.size(); i++) {
+            if (i >= (int)ctx->compareRoutes.size() || !ctx->compareRoutes[i])
+                continue;
+            CompareColumn col;
+            col.route = i;
+            col.name = ctx->router.routes[i].name;
+            col.handle = std::make_shared<RequestHandle>();
+            col.handle->parent = session->handle;
+            session->columns.push_back(col);
         }
     }
+    if (session->columns.empty()) {
+        ctx->AddMessage("system", "Tick at least one model to compare.");
+        return;
+    }
+    memset(ctx->inputBuffer, 0, sizeof(ctx->inputBuffer));
+
+    MessageFragments messages{SystemPromptFragment(), MessageFragment("user", msg)};
+
+    if (ctx->compare)
+        ctx->compare->handle->cancelled = true;
+    ctx->compare = session;
+    session->running = (int)session->columns.size();
+    for (size_t i = 0; i < session->columns.size(); i++) {
+        ctx->requestThreads++;
+        std::thread([ctx, session, i, key, messages]() {
+            RunCompareColumn(ctx, session, i, key, messages);
+            ctx->requestThreads--;
+        }).detach();
+    }
+}
+
+// Options the desktop client, --batch and --gateway have in common. Each
+// mode's parser offers every argument to Parse before its own options.
+struct CommonOptions {
+    std::string routesPath = "routes.json";
+    std::string apiKey; // OPENROUTER_API_KEY, for the headless modes
+
+    CommonOptions() {
+        if (const char* keys = std::getenv("OPENROUTER_API_KEY"))
+            apiKey = keys;
+    }
+
+    // Takes argv[i], and its value, if it is --routes or --trace.
+    bool Parse(int argc, char** argv, int& i) {
+        std::string arg = argv[i];
+        if (arg == "--routes" && i + 1 < argc) {
+            routesPath = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            GetTracer().path = argv[++i];
+            GetTracer().enabled = true;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // Returns the exit status for a bad option, after printing the mode's usage.
+    static int Usage(const std::string& arg, const char* usage) {
+        std::cerr << "Unknown or incomplete option " << arg << "\n"
+                  << "Usage: SchoolBot " << usage << " [--routes routes.json] [--trace trace.json]\n";
+        return 2;
+    }
+
+    // For the headless modes, which have nowhere else to report it.
+    bool LoadRouter(Router& router) const {
+        std::string error = LoadRoutes(router, routesPath);
+        if (!error.empty())
+            std::cerr << "Could not load " << error << "\n";
+        return error.empty();
+    }
+};
+
+// Headless batch mode: `SchoolBot --batch prompts.jsonl` (or `-` for stdin)
+// sends each line's prompt through the router and prints one JSON line per
+// reply. Input lines are {"id", "prompt"} or {"id", "messages": [...]}, with
+// an optional "route" (name or model) and "system" prompt. Up to
+// --concurrency requests run at once over the shared pool; replies come out
+// as they complete, or in input order with --ordered. Keys are read from
+// OPENROUTER_API_KEY, comma separated, so no secret lands in argv.
+struct BatchJob {
+    size_t line = 0; // from 0
+    std::string text;
+    std::string result; // the output line
+    bool failed = false;
+};
+
+void RunBatchJob(NetClient& net, Router& router, BatchJob& job, const std::string& apiKey, int defaultRoute) {
+    std::string id = std::to_string(job.line + 1);
+    std::string routeName;
+    std::string text;
+    std::string error;
+    Usage usage;
+    double ttftMs = -1.0;
+    auto started = std::chrono::steady_clock::now();
+    try {
+        json::value jv = json::parse(job.text);
+        const json::object& obj = jv.as_object();
+        if (auto* v = obj.if_contains("id")) {
+            id.clear();
+            if (v->is_string())
+                AppendJsonString(id, json::value_to<std::string>(*v));
+            else
+                id = json::serialize(*v);
+        }
+
+        int route = defaultRoute;
+        if (auto* v = obj.if_contains("route")) {
+            std::string name = json::value_to<std::string>(*v);
+            std::lock_guard<std::mutex> lock(router.mutex);
+            route = -2;
+            for (int i = 0; i < (int)router.routes.size(); i++)
+                if (router.routes[i].name == name || router.routes[i].model == name)
+                    route = i;
+            if (route == -2)
+                throw std::runtime_error("unknown route " + name);
+        }
+
+        MessageFragments messages;
+        if (auto* v = obj.if_contains("system"))
+            messages.push_back(MessageFragment("system", json::value_to<std::string>(*v)));
+        else
+            messages.push_back(SystemPromptFragment());
+        if (auto* v = obj.if_contains("messages")) {
+            for (const json::value& m : v->as_array())
+                messages.push_back(MessageFragment(json::value_to<std::string>(m.at("role")),
+                                                   json::value_to<std::string>(m.at("content"))));
+        } else {
+            messages.push_back(MessageFragment("user", json::value_to<std::string>(obj.at("prompt"))));
+        }
+
+        auto handle = std::make_shared<RequestHandle>();
+        ChatResult result = SendChatRequest(net, router, handle,
+            [&](const Route& r) { return BuildChatBody(messages, r); }, apiKey,
+            [&](const Route&, const std::string& piece) {
+                text += piece;
+                return true;
+            }, route);
+        usage = result.usage;
+        if (result.route >= 0)
+            routeName = router.Get(result.route).name;
+        if (result.firstToken != std::chrono::steady_clock::time_point{})
+            ttftMs = std::chrono::duration<double, std::milli>(result.firstToken - started).count();
+    } catch (const std::exception& e) {
+        error = e.what();
+    }
+    double totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+
+    job.failed = !error.empty();
+    std::string& out = job.result;
+    out = "{\"id\":";
+    out += id;
+    out += ",\"status\":";
+    out += error.empty() ? "\"ok\"" : "\"error\"";
+    if (!routeName.empty()) {
+        out += ",\"route\":";
+        AppendJsonString(out, routeName);
+    }
+    if (error.empty()) {
+        out += ",\"text\":";
+        AppendJsonString(out, text);
+    } else {
+        out += ",\"error\":";
+        AppendJsonString(out, error);
+    }
+    char numbers[160];
+    std::snprintf(numbers, sizeof(numbers),
+                  ",\"prompt_tokens\":%d,\"completion_tokens\":%d,\"ttft_ms\":%.1f,\"total_ms\":%.1f}",
+                  usage.promptTokens, usage.completionTokens, ttftMs, totalMs);
+    out += numbers;
 }
 
-#ifndef _WEB_BUILD
-void DesktopAPICall(AppContext* ctx, std::string message, std::string apiKey) {
-    try {
-        json::array messages;
-        {
-            std::lock_guard<std::mutex> lock(ctx->historyMutex);
-            messages.push_back({{"role", "system"},
-                                {"content", "You are a helpful assistant."}});
-            int start = (ctx->history.size() > 4) ? ctx->history.size() - 4 : 0;
-            for (size_t i = start; i < ctx->history.size(); i++) {
-                messages.push_back({{"role", ctx->history[i].role},
-                                    {"content", ctx->history[i].content}});
-            }
+int RunBatch(int argc, char** argv) {
+    CommonOptions options;
+    std::string input;
+    std::string routeName;
+    size_t concurrency = 4;
+    bool ordered = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (options.Parse(argc, argv, i))
+            continue;
+        if (arg == "--batch" && i + 1 < argc)
+            input = argv[++i];
+        else if (arg == "--concurrency" && i + 1 < argc)
+            concurrency = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--ordered")
+            ordered = true;
+        else if (arg == "--route" && i + 1 < argc)
+            routeName = argv[++i];
+        else
+            return CommonOptions::Usage(arg, "--batch FILE|- [--concurrency N] [--ordered] [--route NAME]");
+    }
+    const std::string& apiKey = options.apiKey;
+    if (SplitApiKeys(apiKey).empty()) {
+        std::cerr << "Set OPENROUTER_API_KEY to one or more API keys, comma separated\n";
+        return 2;
+    }
+    std::ifstream file;
+    if (input != "-") {
+        file.open(input);
+        if (!file) {
+            std::cerr << "Could not open " << input << "\n";
+            return 2;
         }
+    }
+    std::istream& in = input == "-" ? std::cin : file;
 
-        json::object payload;
-        payload["model"] = "mistralai/mistral-7b-instruct:free";
-        payload["messages"] = messages;
-        std::string requestBody = json::serialize(payload);
+    Router router;
+    if (!options.LoadRouter(router))
+        return 2;
+    int defaultRoute = -1;
+    if (!routeName.empty()) {
+        for (int i = 0; i < (int)router.routes.size(); i++)
+            if (router.routes[i].name == routeName || router.routes[i].model == routeName)
+                defaultRoute = i;
+        if (defaultRoute < 0) {
+            std::cerr << "Unknown route " << routeName << "\n";
+            return 2;
+        }
+    }
 
-        const std::string host = "openrouter.ai";
-        const std::string port = "443";
+    NetClient net;
+    net.pool.maxIdle = std::max(net.pool.maxIdle, concurrency);
+    GetTracer().NameThread("batch");
 
-        net::io_context ioc;
-        ssl::context sslCtx(ssl::context::tlsv12_client);
+    // Workers pull lines as they free up, so a slow reply never holds back
+    // the others. With --ordered, finished lines wait in `done` until every
+    // line before them has been printed.
+    std::mutex mutex;
+    size_t nextLine = 0;
+    size_t nextOut = 0;
+    std::map<size_t, std::string> done;
+    size_t failures = 0;
+    // Called with mutex held; blank lines finish with an empty result.
+    auto finish = [&](BatchJob& job) {
+        failures += job.failed;
+        if (!ordered) {
+            if (!job.result.empty())
+                std::cout << job.result << '\n' << std::flush;
+            return;
+        }
+        done[job.line] = std::move(job.result);
+        for (auto it = done.begin(); it != done.end() && it->first == nextOut; it = done.erase(it), nextOut++)
+            if (!it->second.empty())
+                std::cout << it->second << '\n';
+        std::cout << std::flush;
+    };
+    auto worker = [&] {
+        MemTagScope tag(MemTag::Network);
+        while (true) {
+            BatchJob job;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!std::getline(in, job.text))
+                    return;
+                job.line = nextLine++;
+            }
+            if (job.text.find_first_not_of(" \t\r") != std::string::npos)
+                RunBatchJob(net, router, job, apiKey, defaultRoute);
+            std::lock_guard<std::mutex> lock(mutex);
+            finish(job);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < concurrency; i++)
+        threads.emplace_back(worker);
+    for (std::thread& t : threads)
+        t.join();
+    if (GetTracer().enabled)
+        GetTracer().Save();
+    return failures > 0 ? 1 : 0;
+}
 
-        sslCtx.set_default_verify_paths();
-        sslCtx.set_verify_mode(ssl::verify_peer);
+// Gateway mode: `SchoolBot --gateway 8080` serves an OpenAI-compatible
+// /v1/chat/completions on 127.0.0.1 for other clients on the machine. They
+// share one router, connection pool, response cache and rate limiter.
+// Identical requests in flight at the same time become one upstream call
+// (a "flight") whose reply is streamed to all of them.
+struct GatewayFlight {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::string text;
+    std::string route; // that answered
+    Usage usage;
+    bool done = false;
+    int status = 0; // HTTP status of a failure, 502 for transport errors
+    std::string error;
+    int watchers = 0; // clients still reading; the flight is cancelled at 0
+    std::shared_ptr<RequestHandle> handle = std::make_shared<RequestHandle>();
+};
 
-        tcp::resolver resolver(ioc);
-        beast::ssl_stream<beast::tcp_stream> stream(ioc, sslCtx);
+struct Gateway {
+    NetClient net;
+    Router router;
+    std::string apiKey; // from OPENROUTER_API_KEY; clients' own keys otherwise
+    RateLimiter global; // --rpm, over all upstream requests
+    bool limited = false;
+    size_t maxInflight = 16;
+    std::mutex inflightMutex;
+    std::condition_variable inflightFreed;
+    size_t inflight = 0;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<GatewayFlight>> flights; // by request key
+    // Running RunGatewayFlight threads. A flight leaves `flights` before its
+    // thread ends, and a cancelled one may be replaced there earlier still.
+    size_t flightThreads = 0;
+    std::atomic<unsigned> nextId{1};
+    bool verbose = false; // --verbose: one line per request on stderr
+    // Client connections, one thread each. Past maxConnections the gateway
+    // stops accepting and new clients wait in the listen backlog.
+    size_t maxConnections = 64;
+    std::mutex connectionsMutex;
+    size_t connections = 0;
+    std::vector<tcp::socket*> sockets; // open client sockets, shut down on exit
+    bool accepting = false;
+    bool stopping = false; // SIGINT or SIGTERM
+};
 
-        if (!SSL_set_tlsext_host_name(stream.native_handle(), host.c_str())) {
-            beast::error_code ec{static_cast<int>(::ERR_get_error()),
-                                 net::error::get_ssl_category()};
-            throw beast::system_error{ec};
+// Fetches one flight's reply upstream, waiting first for a free upstream
+// slot and the global rate limit.
+void RunGatewayFlight(Gateway& gw, std::shared_ptr<GatewayFlight> flight, std::string key, std::string apiKey,
+                      std::string extras, MessageFragments messages, MessageFragments keyed, int route) {
+    MemTagScope tag(MemTag::Network);
+    RequestHandle& handle = *flight->handle;
+    bool admitted;
+    {
+        std::unique_lock<std::mutex> lock(gw.inflightMutex);
+        while (gw.inflight >= gw.maxInflight && !handle.IsCancelled())
+            gw.inflightFreed.wait_for(lock, kCancelPollInterval * 20);
+        // A flight cancelled while queued never takes a slot.
+        admitted = !handle.IsCancelled();
+        if (admitted)
+            gw.inflight++;
+    }
+    try {
+        if (!admitted)
+            throw RequestError("Cancelled", 499, false);
+        if (gw.limited) {
+            RateLimiter::Reservation slot = gw.global.Reserve({"gateway"}, "");
+            if (slot.wait.count() > 0 && !SleepUnlessCancelled(handle, slot.wait))
+                gw.global.Release(slot, "");
         }
+        if (handle.IsCancelled())
+            throw RequestError("Cancelled", 499, false);
+        auto bodyFor = [&](const Route& r) {
+            ChatBody body = BuildChatBody(messages, r);
+            body.head.insert(body.head.size() - std::strlen(",\"messages\":["), extras);
+            return body;
+        };
+        ChatResult result = SendChatRequest(gw.net, gw.router, flight->handle, bodyFor, apiKey,
+            [&](const Route&, const std::string& text) {
+                std::lock_guard<std::mutex> lock(flight->mutex);
+                flight->text += text;
+                flight->changed.notify_all();
+                return flight->watchers > 0;
+            }, route);
+        std::lock_guard<std::mutex> lock(flight->mutex);
+        flight->usage = result.usage;
+        if (result.route >= 0)
+            flight->route = gw.router.Get(result.route).name;
+        if (!handle.IsCancelled() && result.route >= 0 && !flight->text.empty())
+            gw.net.cache.Put(ResponseCache::Key(gw.router.Get(result.route), keyed),
+                             {flight->route, flight->text, result.usage});
+    } catch (const RequestError& e) {
+        std::lock_guard<std::mutex> lock(flight->mutex);
+        flight->status = e.status >= 400 ? e.status : 502;
+        flight->error = e.what();
+    } catch (const std::exception& e) {
+        std::lock_guard<std::mutex> lock(flight->mutex);
+        flight->status = 502;
+        flight->error = e.what();
+    }
+    if (admitted) {
+        {
+            std::lock_guard<std::mutex> lock(gw.inflightMutex);
+            gw.inflight--;
+        }
+        gw.inflightFreed.notify_one();
+    }
+    // Later identical requests go to the cache from here on.
+    {
+        std::lock_guard<std::mutex> lock(gw.mutex);
+        auto it = gw.flights.find(key);
+        if (it != gw.flights.end() && it->second == flight)
+            gw.flights.erase(it);
+    }
+    {
+        std::lock_guard<std::mutex> lock(flight->mutex);
+        flight->done = true;
+        flight->changed.notify_all();
+    }
+    // Last use of gw: RunGateway returns once no flight thread is left.
+    std::lock_guard<std::mutex> lock(gw.mutex);
+    gw.flightThreads--;
+}
 
-        auto const results = resolver.resolve(host, port);
-        beast::get_lowest_layer(stream).connect(results);
-        stream.handshake(ssl::stream_base::client);
-
-        http::request<http::string_body> req{http::verb::post,
-                                             "/api/v1/chat/completions", 11};
-        req.set(http::field::host, host);
-        req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
-        req.set(http::field::content_type, "application/json");
-        req.set(http::field::authorization, "Bearer " + apiKey);
-        req.body() = requestBody;
-        req.prepare_payload();
+std::string GatewayError(const std::string& message) {
+    std::string body = "{\"error\":{\"message\":";
+    AppendJsonString(body, message);
+    body += "}}";
+    return body;
+}
 
-        http::write(stream, req);
+// One OpenAI-style chunk or completion object around `text`.
+std::string GatewayCompletion(const std::string& id, const std::string& model, std::string_view text,
+                              bool chunk, const char* finish, const Usage* usage) {
+    std::string out = "{\"id\":";
+    AppendJsonString(out, id);
+    out += chunk ? ",\"object\":\"chat.completion.chunk\"" : ",\"object\":\"chat.completion\"";
+    out += ",\"created\":" + std::to_string((long long)std::time(nullptr)) + ",\"model\":";
+    AppendJsonString(out, model);
+    out += chunk ? ",\"choices\":[{\"index\":0,\"delta\":{" : ",\"choices\":[{\"index\":0,\"message\":{";
+    out += "\"role\":\"assistant\",\"content\":";
+    AppendJsonString(out, text);
+    out += "},\"finish_reason\":";
+    out += finish ? std::string("\"") + finish + "\"" : "null";
+    out += "}]";
+    if (usage && usage->promptTokens >= 0)
+        out += ",\"usage\":{\"prompt_tokens\":" + std::to_string(usage->promptTokens) +
+               ",\"completion_tokens\":" + std::to_string(std::max(usage->completionTokens, 0)) +
+               ",\"total_tokens\":" + std::to_string(usage->promptTokens + std::max(usage->completionTokens, 0)) +
+               "}";
+    out += '}';
+    return out;
+}
 
-        beast::flat_buffer buffer;
-        http::response<http::string_body> res;
-        http::read(stream, buffer, res);
+// Answers one /v1/chat/completions request: from the cache, by joining an
+// identical flight, or by starting one. Returns false once the client has
+// gone away.
+bool ServeGatewayChat(Gateway& gw, beast::tcp_stream& stream, const http::request<http::string_body>& req) {
+    const char* source = nullptr; // hit, shared or miss, once looked up
+    auto respond = [&](http::status status, const std::string& body) {
+        http::response<http::string_body> res{status, req.version()};
+        res.set(http::field::content_type, "application/json");
+        if (source)
+            res.set("X-SchoolBot-Cache", source);
+        res.keep_alive(req.keep_alive());
+        res.body() = body;
+        res.prepare_payload();
+        beast::error_code ec;
+        http::write(stream, res, ec);
+        return !ec;
+    };
 
-        json::value jv = json::parse(res.body());
-        std::string reply = json::value_to<std::string>(
-            jv.at("choices").at(0).at("message").at("content"));
+    std::string model = "auto";
+    std::string extras;
+    bool streaming = false;
+    int route = -1;
+    MessageFragments messages;
+    try {
+        json::value jv = json::parse(req.body());
+        for (const json::key_value_pair& field : jv.as_object()) {
+            std::string_view name(field.key().data(), field.key().size());
+            const json::value& value = field.value();
+            if (name == "model") {
+                model = json::value_to<std::string>(value);
+            } else if (name == "stream") {
+                streaming = value.as_bool();
+            } else if (name == "messages") {
+                for (const json::value& m : value.as_array())
+                    messages.push_back(std::make_shared<const std::string>(json::serialize(m)));
+            } else if (name != "stream_options") {
+                // Sampling parameters and the like go upstream as they are.
+                extras += ',';
+                AppendJsonString(extras, name);
+                extras += ':';
+                extras += json::serialize(value);
+            }
+        }
+    } catch (const std::exception& e) {
+        return respond(http::status::bad_request, GatewayError(std::string("Invalid request: ") + e.what()));
+    }
+    if (messages.empty())
+        return respond(http::status::bad_request, GatewayError("No messages"));
+    std::vector<Route> candidates;
+    {
+        std::lock_guard<std::mutex> lock(gw.router.mutex);
+        for (int i = 0; i < (int)gw.router.routes.size(); i++)
+            if (gw.router.routes[i].name == model || gw.router.routes[i].model == model)
+                route = i;
+        if (route >= 0)
+            candidates.push_back(gw.router.routes[route]);
+        else if (model == "auto")
+            candidates = gw.router.routes;
+        else
+            return respond(http::status::not_found, GatewayError("Unknown model " + model));
+    }
+    std::string apiKey = gw.apiKey;
+    if (apiKey.empty()) {
+        std::string_view auth(req[http::field::authorization].data(), req[http::field::authorization].size());
+        if (auth.substr(0, 7) == "Bearer ")
+            apiKey = std::string(auth.substr(7));
+    }
+    if (SplitApiKeys(apiKey).empty())
+        return respond(http::status::unauthorized, GatewayError("No API key"));
 
-        ctx->AddMessage("assistant", reply);
+    // Requests differing only in parameters are different requests.
+    MessageFragments keyed = messages;
+    keyed.push_back(std::make_shared<const std::string>(extras));
+    // Replies paid for with a client's own key are shared with that key
+    // only. Key() hashes it, so it never reaches the cache's file names.
+    if (gw.apiKey.empty())
+        keyed.push_back(std::make_shared<const std::string>("key:" + apiKey));
+    Route keyRoute;
+    keyRoute.model = model;
+    std::string key = ResponseCache::Key(keyRoute, keyed);
+    bool bypassCache = req[http::field::cache_control].find("no-cache") != beast::string_view::npos;
 
-        beast::error_code ec;
-        stream.shutdown(ec);
-    } catch (std::exception const &e) {
-        ctx->AddMessage("system", std::string("Error: ") + e.what());
+    std::shared_ptr<GatewayFlight> flight;
+    source = "miss";
+    for (const Route& r : candidates) {
+        if (bypassCache || !gw.net.cache.enabled)
+            break;
+        if (auto hit = gw.net.cache.Get(ResponseCache::Key(r, keyed))) {
+            flight = std::make_shared<GatewayFlight>();
+            flight->text = hit->text;
+            flight->route = hit->route;
+            flight->usage = hit->usage;
+            flight->done = true;
+            source = "hit";
+            break;
+        }
     }
-    ctx->isWaiting = false;
-}
-#endif
+    if (!flight) {
+        std::lock_guard<std::mutex> lock(gw.mutex);
+        std::shared_ptr<GatewayFlight>& slot = gw.flights[key];
+        if (slot) {
+            // Not one whose clients have all left and cancelled it.
+            std::lock_guard<std::mutex> flightLock(slot->mutex);
+            if (!slot->handle->IsCancelled()) {
+                flight = slot;
+                flight->watchers++;
+                source = "shared";
+            }
+        }
+        if (!flight) {
+            flight = slot = std::make_shared<GatewayFlight>();
+            flight->watchers = 1;
+            gw.flightThreads++;
+            std::thread(RunGatewayFlight, std::ref(gw), flight, key, apiKey, extras, messages, keyed, route).detach();
+        }
+    }
+    // A client leaving early stops counting; the last one out cancels.
+    auto leave = [&] {
+        std::lock_guard<std::mutex> lock(flight->mutex);
+        if (--flight->watchers <= 0 && !flight->done)
+            flight->handle->cancelled = true;
+    };
 
-#ifdef _WEB_BUILD
-void onFetchSuccess(emscripten_fetch_t *fetch) {
-    std::string response(fetch->data, fetch->numBytes);
-    emscripten_fetch_close(fetch);
+    std::string id = "chatcmpl-gw" + std::to_string(gw.nextId++);
+    std::unique_lock<std::mutex> lock(flight->mutex);
+    if (!streaming) {
+        flight->changed.wait(lock, [&] { return flight->done; });
+        bool failed = !flight->error.empty();
+        std::string body = failed ? GatewayError(flight->error)
+                                  : GatewayCompletion(id, flight->route, flight->text, false, "stop", &flight->usage);
+        http::status status = failed ? http::int_to_status(flight->status) : http::status::ok;
+        lock.unlock();
+        leave();
+        if (gw.verbose)
+            std::cerr << model << " " << source << " " << (int)status << "\n";
+        return respond(status, body);
+    }
 
-    try {
-        json::value jv = json::parse(response);
-        std::string reply = json::value_to<std::string>(
-            jv.at("choices").at(0).at("message").at("content"));
-        g_webContext->AddMessage("assistant", reply);
-    } catch (...) {
-        g_webContext->AddMessage("system", "Error parsing JSON response");
+    // Headers wait for the first text, so a failure before it still gets
+    // its own HTTP status.
+    flight->changed.wait(lock, [&] { return flight->done || !flight->text.empty(); });
+    if (flight->text.empty() && !flight->error.empty()) {
+        http::status status = http::int_to_status(flight->status);
+        std::string body = GatewayError(flight->error);
+        lock.unlock();
+        leave();
+        if (gw.verbose)
+            std::cerr << model << " " << source << " " << (int)status << "\n";
+        return respond(status, body);
+    }
+    http::response<http::empty_body> res{http::status::ok, req.version()};
+    res.set(http::field::content_type, "text/event-stream");
+    res.set(http::field::cache_control, "no-cache");
+    res.set("X-SchoolBot-Cache", source);
+    res.keep_alive(req.keep_alive());
+    res.chunked(true);
+    http::response_serializer<http::empty_body> sr{res};
+    beast::error_code ec;
+    size_t sent = 0;
+    lock.unlock();
+    http::write_header(stream, sr, ec);
+    lock.lock();
+    while (!ec) {
+        flight->changed.wait(lock, [&] { return flight->done || flight->text.size() > sent; });
+        std::string event;
+        if (flight->text.size() > sent) {
+            event = "data: " + GatewayCompletion(id, flight->route, std::string_view(flight->text).substr(sent), true,
+                                                 nullptr, nullptr) + "\n\n";
+            sent = flight->text.size();
+        }
+        bool done = flight->done;
+        if (done) {
+            event += "data: " + (flight->error.empty()
+                                     ? GatewayCompletion(id, flight->route, "", true, "stop", &flight->usage)
+                                     : GatewayError(flight->error)) + "\n\ndata: [DONE]\n\n";
+        }
+        lock.unlock();
+        net::write(stream, http::make_chunk(net::buffer(event)), ec);
+        if (!ec && done)
+            net::write(stream, http::make_chunk_last(), ec);
+        lock.lock();
+        if (done)
+            break;
     }
-    g_webContext->isWaiting = false;
+    lock.unlock();
+    leave();
+    if (gw.verbose)
+        std::cerr << model << " " << source << " " << (ec ? "client gone" : "200") << "\n";
+    return !ec;
 }
 
-void onFetchError(emscripten_fetch_t *fetch) {
-    emscripten_fetch_close(fetch);
-    g_webContext->AddMessage("system", "Network Error (Check console)");
-    g_webContext->isWaiting = false;
+void ServeGatewayConnection(Gateway& gw, tcp::socket socket) {
+    MemTagScope tag(MemTag::Network);
+    beast::tcp_stream stream(std::move(socket));
+    {
+        std::lock_guard<std::mutex> lock(gw.connectionsMutex);
+        if (gw.stopping)
+            return;
+        gw.sockets.push_back(&stream.socket());
+    }
+    beast::flat_buffer buffer;
+    while (true) {
+        http::request_parser<http::string_body> parser;
+        parser.body_limit(64 << 20);
+        beast::error_code ec;
+        http::read(stream, buffer, parser, ec);
+        if (ec)
+            break;
+        const http::request<http::string_body>& req = parser.get();
+        std::string_view target(req.target().data(), req.target().size());
+        bool ok = true;
+        if (req.method() == http::verb::post &&
+            (target == "/v1/chat/completions" || target == "/api/v1/chat/completions")) {
+            ok = ServeGatewayChat(gw, stream, req);
+        } else {
+            http::response<http::string_body> res{http::status::ok, req.version()};
+            res.set(http::field::content_type, "application/json");
+            if (req.method() == http::verb::get && (target == "/v1/models" || target == "/api/v1/models")) {
+                res.body() = "{\"object\":\"list\",\"data\":[";
+                std::lock_guard<std::mutex> lock(gw.router.mutex);
+                for (const Route& r : gw.router.routes) {
+                    res.body() += "{\"object\":\"model\",\"id\":";
+                    AppendJsonString(res.body(), r.name);
+                    res.body() += "},";
+                }
+                res.body() += "{\"object\":\"model\",\"id\":\"auto\"}]}";
+            } else {
+                res.result(http::status::not_found);
+                res.body() = GatewayError("Not found");
+            }
+            res.keep_alive(req.keep_alive());
+            res.prepare_payload();
+            http::write(stream, res, ec);
+            ok = !ec;
+        }
+        if (!ok || !req.keep_alive())
+            break;
+    }
+    std::lock_guard<std::mutex> lock(gw.connectionsMutex);
+    gw.sockets.erase(std::find(gw.sockets.begin(), gw.sockets.end(), &stream.socket()));
+    beast::error_code ignored;
+    stream.socket().shutdown(tcp::socket::shutdown_both, ignored);
 }
 
-void WebAPICall(std::string message, std::string apiKey) {
-    json::array messages;
-    messages.push_back({{"role", "user"}, {"content", message}});
-
-    json::object payload;
-    payload["model"] = "mistralai/mistral-7b-instruct:free";
-    payload["messages"] = messages;
-    std::string requestBody = json::serialize(payload);
-
-    emscripten_fetch_attr_t attr;
-    emscripten_fetch_attr_init(&attr);
-    strcpy(attr.requestMethod, "POST");
-    attr.attributes = EMSCRIPTEN_FETCH_LOAD_TO_MEMORY;
-    attr.onsuccess = onFetchSuccess;
-    attr.onerror = onFetchError;
+int RunGateway(int argc, char** argv) {
+    CommonOptions options;
+    int port = 0;
+    Gateway gw;
+    gw.net.cache.enabled = true;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (options.Parse(argc, argv, i))
+            continue;
+        if (arg == "--gateway" && i + 1 < argc)
+            port = std::atoi(argv[++i]);
+        else if (arg == "--max-inflight" && i + 1 < argc)
+            gw.maxInflight = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--max-connections" && i + 1 < argc)
+            gw.maxConnections = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--rpm" && i + 1 < argc) {
+            gw.global.SetLimit("gateway", "", std::atof(argv[++i]));
+            gw.limited = true;
+        } else if (arg == "--no-cache")
+            gw.net.cache.enabled = false;
+        else if (arg == "--verbose")
+            gw.verbose = true;
+        else
+            return CommonOptions::Usage(arg, "--gateway PORT [--max-inflight N] [--max-connections N] [--rpm N]"
+                                             " [--no-cache] [--verbose]");
+    }
+    if (port <= 0 || port > 65535) {
+        std::cerr << "--gateway needs a port\n";
+        return 2;
+    }
+    if (!options.LoadRouter(gw.router))
+        return 2;
+    gw.apiKey = options.apiKey;
+    gw.net.pool.maxIdle = std::max(gw.net.pool.maxIdle, gw.maxInflight);
 
-    static std::vector<const char *> headers;
-    headers.clear();
-    static std::string authHeader = "Bearer " + apiKey;
-    headers.push_back("Content-Type");
-    headers.push_back("application/json");
-    headers.push_back("Authorization");
-    headers.push_back(authHeader.c_str());
-    headers.push_back("HTTP-Referer");
-    headers.push_back("http://localhost:8000");
-    headers.push_back(NULL);
+    net::io_context ioc;
+    tcp::acceptor acceptor(ioc);
+    tcp::endpoint endpoint(net::ip::address_v4::loopback(), (unsigned short)port);
+    beast::error_code ec;
+    acceptor.open(endpoint.protocol(), ec);
+    if (!ec)
+        acceptor.set_option(net::socket_base::reuse_address(true), ec);
+    if (!ec)
+        acceptor.bind(endpoint, ec);
+    if (!ec)
+        acceptor.listen(net::socket_base::max_listen_connections, ec);
+    if (ec) {
+        std::cerr << "Could not listen on port " << port << ": " << ec.message() << "\n";
+        return 1;
+    }
+    std::cerr << "Gateway listening on http://127.0.0.1:" << port << "/v1/chat/completions\n";
 
-    attr.requestHeaders = headers.data();
-    attr.requestData = requestBody.c_str();
-    attr.requestDataSize = requestBody.size();
+    // Accepting runs on ioc alongside the signal handler. At maxConnections
+    // the next accept waits until a connection thread finishes.
+    std::function<void()> acceptNext = [&] {
+        acceptor.async_accept([&](beast::error_code ec, tcp::socket socket) {
+            {
+                std::lock_guard<std::mutex> lock(gw.connectionsMutex);
+                gw.accepting = false;
+                if (gw.stopping)
+                    return;
+                if (!ec) {
+                    gw.connections++;
+                    std::thread([&gw, &ioc, &acceptNext, socket = std::move(socket)]() mutable {
+                        ServeGatewayConnection(gw, std::move(socket));
+                        std::lock_guard<std::mutex> lock(gw.connectionsMutex);
+                        gw.connections--;
+                        if (!gw.accepting && !gw.stopping) {
+                            gw.accepting = true;
+                            net::post(ioc, acceptNext);
+                        }
+                    }).detach();
+                }
+                gw.accepting = gw.connections < gw.maxConnections;
+                if (gw.accepting)
+                    acceptNext();
+            }
+            gw.net.pool.Prune();
+        });
+    };
+    net::signal_set signals(ioc, SIGINT, SIGTERM);
+    signals.async_wait([&](const beast::error_code&, int) {
+        std::lock_guard<std::mutex> lock(gw.connectionsMutex);
+        gw.stopping = true;
+        beast::error_code ignored;
+        acceptor.close(ignored);
+    });
+    gw.accepting = true;
+    acceptNext();
+    ioc.run();
 
-    emscripten_fetch(&attr, "https://openrouter.ai/api/v1/chat/completions");
+    // Cancel upstream work and unblock client reads until every connection
+    // and flight thread has let go of gw.
+    std::cerr << "Gateway stopping\n";
+    while (true) {
+        bool idle;
+        {
+            std::lock_guard<std::mutex> lock(gw.mutex);
+            for (auto& flight : gw.flights)
+                flight.second->handle->cancelled = true;
+            idle = gw.flightThreads == 0;
+        }
+        {
+            std::lock_guard<std::mutex> lock(gw.connectionsMutex);
+            beast::error_code ignored;
+            for (tcp::socket* socket : gw.sockets)
+                socket->shutdown(tcp::socket::shutdown_both, ignored);
+            idle = idle && gw.connections == 0;
+        }
+        if (idle)
+            return 0;
+        std::this_thread::sleep_for(kCancelPollInterval);
+    }
 }
 #endif
 
-void SendMessage(AppContext* ctx) {
-    std::string msg = ctx->inputBuffer;
-    std::string key = ctx->apiKeyBuffer;
-    if (msg.empty())
-        return;
-    if (key.empty()) {
-        ctx->AddMessage("system", "Please enter API Key first.");
-        return;
+// Stops the active request. Whatever text has already streamed in stays in
+// history; the UI is released immediately and the network thread notices the
+// flag within kCancelPollInterval.
+void CancelRequest(AppContext* ctx) {
+    std::shared_ptr<RequestHandle> req;
+    MessageNode* parent = nullptr;
+    {
+        auto lock = TraceLock(ctx->historyMutex, "wait history");
+        req = std::move(ctx->activeRequest);
+        if (!req)
+            return;
+        req->cancelled = true;
+        // Under the cancelled reply, like FailRequest, even if the UI has
+        // since switched to another branch.
+        parent = req->reply ? req->reply : req->anchor;
+        // No more text will be appended; index the reply's last word.
+        if (req->reply)
+            ctx->searchIndex.Index(*req->reply, true);
+        ctx->isWaiting = false;
     }
-
-    ctx->AddMessage("user", msg);
-    memset(ctx->inputBuffer, 0, sizeof(ctx->inputBuffer));
-    ctx->isWaiting = true;
-
 #ifdef _WEB_BUILD
-    WebAPICall(msg, key);
-#else
-    std::thread([ctx, msg, key]() { DesktopAPICall(ctx, msg, key); }).detach();
+    // Closing an in-progress fetch aborts it; no callback fires afterwards.
+    if (req->fetch)
+        emscripten_fetch_close(req->fetch);
 #endif
+    ctx->AddMessage("system", "Stopped.", parent);
 }
 
 void ApplyCoolStyle() {
@@ -451,14 +5608,134 @@ void ApplyCoolStyle() {
     style.Colors[ImGuiCol_Button] = ImVec4(0.3f, 0.3f, 0.4f, 1.00f);
 }
 
-void RenderMessage(const ChatMessage& m) {
+// Puts a background behind each word of [begin, end) that is one of
+// `terms`, for text about to be drawn at the cursor. Lines are broken the
+// way ImGui breaks them: at newlines, and where a line would pass
+// `wrapWidth` unless that is 0.
+void DrawSearchHighlights(const char* begin, const char* end, const std::vector<std::string>& terms,
+                          float wrapWidth) {
+    ImVec2 origin = ImGui::GetCursorScreenPos();
+    ImFont* font = ImGui::GetFont();
+    float scale = ImGui::GetFontSize() / font->FontSize;
+    float lineHeight = ImGui::GetTextLineHeight();
+    ImDrawList* drawList = ImGui::GetWindowDrawList();
+    ImU32 color = ImGui::GetColorU32(ImVec4(0.9f, 0.75f, 0.2f, 0.35f));
+    float y = origin.y;
+    auto mark = [&](const char* line, const char* lineEnd) {
+        ForEachWord(std::string_view(line, lineEnd - line), [&](size_t b, size_t e) {
+            if (!IsSearchTerm(std::string_view(line + b, e - b), terms))
+                return;
+            float x0 = ImGui::CalcTextSize(line, line + b).x;
+            float x1 = ImGui::CalcTextSize(line, line + e).x;
+            drawList->AddRectFilled(ImVec2(origin.x + x0, y), ImVec2(origin.x + x1, y + lineHeight), color);
+        });
+        y += lineHeight;
+    };
+    for (const char* s = begin;;) {
+        const char* newline = std::find(s, end, '\n');
+        const char* line = s;
+        for (;;) {
+            const char* lineEnd = newline;
+            if (wrapWidth > 0.0f) {
+                lineEnd = font->CalcWordWrapPositionA(scale, line, newline, wrapWidth);
+                if (lineEnd == line && line < newline)
+                    lineEnd++; // too narrow for even one character
+            }
+            mark(line, lineEnd);
+            if (lineEnd >= newline)
+                break;
+            // A wrap swallows the blanks after it, and a newline right
+            // after those.
+            line = lineEnd;
+            while (line < newline && (*line == ' ' || *line == '\t'))
+                line++;
+            if (line == newline)
+                break;
+        }
+        if (newline == end)
+            break;
+        s = newline + 1;
+    }
+}
+
+constexpr size_t kMaxSearchResults = 200;
+
+// Search box over the whole conversation, every branch included. Results
+// are refreshed whenever the index has grown; picking one makes its
+// branch active and scrolls to it.
+void RenderSearch(AppContext* ctx) {
+    SearchView& search = ctx->search;
+    ImGui::SetNextItemWidth(300);
+    bool edited = ImGui::InputTextWithHint("##search", "Search history (\"phrase\")", search.query,
+                                           sizeof(search.query));
+    if (!search.query[0]) {
+        if (edited) {
+            search.results.clear();
+            search.matched.clear();
+            search.terms.clear();
+        }
+        return;
+    }
+
+    auto lock = TraceLock(ctx->historyMutex, "wait history");
+    if (edited || search.generation != ctx->searchIndex.generation) {
+        TraceSpan span("search", "ui");
+        auto start = std::chrono::steady_clock::now();
+        search.results = ctx->searchIndex.Query(search.query, kMaxSearchResults);
+        search.queryMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        search.generation = ctx->searchIndex.generation;
+        search.terms.clear();
+        std::string_view query = search.query;
+        ForEachWord(query, [&](size_t b, size_t e) { search.terms.push_back(FoldWord(query.substr(b, e - b))); });
+        search.matched.clear();
+        for (const SearchIndex::Result& r : search.results)
+            search.matched.push_back(r.node);
+        std::sort(search.matched.begin(), search.matched.end());
+    }
+
+    ImGui::SameLine();
+    ImGui::TextDisabled("%zu%s match(es) in %.2f ms", search.results.size(),
+                        search.results.size() == kMaxSearchResults ? "+" : "", search.queryMs);
+    if (search.results.empty())
+        return;
+    float height = std::min<float>(search.results.size(), 6) * ImGui::GetTextLineHeightWithSpacing() + 8;
+    ImGui::BeginChild("search results", ImVec2(0, height), true);
+    for (size_t i = 0; i < search.results.size(); i++) {
+        const SearchIndex::Result& r = search.results[i];
+        // A snippet around the match, on one line.
+        std::string_view text = r.node->message.content.View();
+        size_t begin = r.offset > 40 ? r.offset - 40 : 0;
+        size_t lineStart = text.rfind('\n', r.offset);
+        if (lineStart != std::string_view::npos && lineStart + 1 > begin)
+            begin = lineStart + 1;
+        size_t end = std::min(text.find('\n', r.offset), std::min(text.size(), (size_t)r.offset + 80));
+        ImGui::PushID((int)i);
+        if (ImGui::Selectable("##result")) {
+            ctx->history.Show(r.node);
+            search.scrollTarget = r.node;
+            ctx->scrollToBottom = false;
+        }
+        ImGui::SameLine();
+        ImGui::TextDisabled("%s:", r.node->message.role.c_str());
+        ImGui::SameLine();
+        ImGui::TextUnformatted(text.data() + begin, text.data() + end);
+        ImGui::PopID();
+    }
+    ImGui::EndChild();
+}
+
+// `terms`, if given, are search words to highlight.
+void RenderMessage(const ChatMessage& m, const std::vector<std::string>* terms = nullptr) {
     if (m.role == "user") {
         ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.5f, 0.8f, 1.0f, 1.0f));
         ImGui::Text("> YOU");
         ImGui::PopStyleColor();
     } else if (m.role == "assistant") {
         ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.6f, 1.0f, 0.6f, 1.0f));
-        ImGui::Text("> BOT");
+        if (m.model.empty())
+            ImGui::Text("> BOT");
+        else
+            ImGui::Text("> BOT (%s%s)", m.model.c_str(), m.cached ? ", cached" : "");
         ImGui::PopStyleColor();
     } else {
         ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.0f, 0.4f, 0.4f, 1.0f));
@@ -467,67 +5744,283 @@ void RenderMessage(const ChatMessage& m) {
     }
     
     ImGui::Indent(10);
-    
-    auto codeBlocks = ExtractCodeBlocks(m.content);
-    
-    if (codeBlocks.empty()) {
-        ImGui::TextWrapped("%s", m.content.c_str());
-    } else {
-        std::regex pattern(R"(```\w*\s*\n[\s\S]*?```)");
-        
-        std::string remaining = m.content;
-        auto searchStart = remaining.cbegin();
-        std::smatch match;
-        int blockIdx = 0;
-        
-        while (std::regex_search(searchStart, remaining.cend(), match, pattern)) {
-            std::string before(searchStart, match[0].first);
-            if (!before.empty() && before != "\n") {
-                ImGui::TextWrapped("%s", before.c_str());
-            }
-            
-            if (blockIdx < (int)codeBlocks.size()) {
-                ImGui::Spacing();
-                ImGui::PushStyleColor(ImGuiCol_ChildBg, ImVec4(0.12f, 0.12f, 0.15f, 1.0f));
-                
-                int numLines = std::count(codeBlocks[blockIdx].code.begin(), 
-                                         codeBlocks[blockIdx].code.end(), '\n') + 3;
-                float height = numLines * ImGui::GetTextLineHeightWithSpacing() + 20;
-                
-                ImGui::BeginChild(("code_" + std::to_string((size_t)&m) + "_" + std::to_string(blockIdx)).c_str(), 
-                                ImVec2(0, height), true);
-                
-                ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.6f, 0.6f, 0.6f, 1.0f));
-                ImGui::Text("[%s]", codeBlocks[blockIdx].language.c_str());
-                ImGui::PopStyleColor();
-                
-                ImGui::Separator();
-                
-                RenderHighlightedCode(codeBlocks[blockIdx].code, codeBlocks[blockIdx].language);
-                
-                ImGui::EndChild();
-                ImGui::PopStyleColor();
-                ImGui::Spacing();
-                
-                blockIdx++;
-            }
-            
-            searchStart = match.suffix().first;
+
+    std::string_view content = m.content.View();
+    if (!m.layout)
+        m.layout = BuildMessageLayout(content);
+    const MessageLayout& layout = *m.layout;
+    ImGui::PushID(&m);
+    for (const MessageLayout::Part& part : layout.parts) {
+        if (part.code < 0) {
+            ImGui::PushTextWrapPos(0.0f);
+            if (terms)
+                DrawSearchHighlights(content.data() + part.begin, content.data() + part.end, *terms,
+                                     std::max(ImGui::GetContentRegionAvail().x, 1.0f));
+            ImGui::TextUnformatted(content.data() + part.begin, content.data() + part.end);
+            ImGui::PopTextWrapPos();
+            continue;
         }
-        
-        if (searchStart != remaining.cend()) {
-            std::string after(searchStart, remaining.cend());
-            if (!after.empty() && after != "\n") {
-                ImGui::TextWrapped("%s", after.c_str());
-            }
+        const MessageLayout::Code& code = layout.codes[part.code];
+        ImGui::Spacing();
+        ImGui::PushStyleColor(ImGuiCol_ChildBg, ImVec4(0.12f, 0.12f, 0.15f, 1.0f));
+
+        float height = code.numLines * ImGui::GetTextLineHeightWithSpacing() + 20;
+
+        ImGui::PushID(part.code);
+        ImGui::BeginChild("code", ImVec2(0, height), true);
+
+        ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.6f, 0.6f, 0.6f, 1.0f));
+        ImGui::Text("[%s]", code.language.c_str());
+        ImGui::PopStyleColor();
+
+        ImGui::Separator();
+
+        for (const auto& line : code.lines) {
+            if (terms)
+                DrawSearchHighlights(code.code.data() + line.begin, code.code.data() + line.end, *terms, 0.0f);
+            RenderHighlightedLine(code.code, line);
         }
+
+        ImGui::EndChild();
+        ImGui::PopID();
+        ImGui::PopStyleColor();
+        ImGui::Spacing();
     }
-    
+    ImGui::PopID();
+
     ImGui::Unindent(10);
     ImGui::Spacing();
     ImGui::Separator();
 }
 
+// Route picker plus the live statistics the router decides on.
+void RenderRoutes(Router& router) {
+    std::lock_guard<std::mutex> lock(router.mutex);
+
+    const char* preview = router.pinned >= 0 ? router.routes[router.pinned].name.c_str()
+                                             : "Auto (fastest)";
+    ImGui::SetNextItemWidth(300);
+    if (ImGui::BeginCombo("Model", preview)) {
+        if (ImGui::Selectable("Auto (fastest)", router.pinned < 0))
+            router.pinned = -1;
+        for (int i = 0; i < (int)router.routes.size(); i++) {
+            if (ImGui::Selectable(router.routes[i].name.c_str(), router.pinned == i))
+                router.pinned = i;
+        }
+        ImGui::EndCombo();
+    }
+
+    if (ImGui::CollapsingHeader("Route statistics")) {
+        if (ImGui::BeginTable("routes", 5, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+            ImGui::TableSetupColumn("Route");
+            ImGui::TableSetupColumn("TTFT ms");
+            ImGui::TableSetupColumn("tok/s");
+            ImGui::TableSetupColumn("Errors");
+            ImGui::TableSetupColumn("Samples");
+            ImGui::TableHeadersRow();
+            for (size_t i = 0; i < router.routes.size(); i++) {
+                const RouteStats& st = router.stats[i];
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn();
+                ImGui::TextUnformatted(router.routes[i].name.c_str());
+                ImGui::TableNextColumn();
+                ImGui::Text("%.0f", st.ttftMs);
+                ImGui::TableNextColumn();
+                ImGui::Text("%.1f", st.tokensPerSec);
+                ImGui::TableNextColumn();
+                ImGui::Text("%.0f%%", st.errorRate * 100.0);
+                ImGui::TableNextColumn();
+                ImGui::Text("%d", st.samples);
+            }
+            ImGui::EndTable();
+        }
+    }
+}
+
+#ifndef _WEB_BUILD
+// Per-route aggregates over the requests still in the ledger's ring.
+void RenderLedger(UsageLedger& ledger, std::pmr::memory_resource* arena) {
+    if (!ImGui::CollapsingHeader("Usage"))
+        return;
+
+    struct Aggregate {
+        std::pmr::string route;
+        int requests = 0;
+        int errors = 0;
+        long long promptTokens = 0;
+        long long completionTokens = 0;
+        long long cachedTokens = 0;
+        std::uint64_t bytes = 0;
+        int retries = 0;
+        std::uint64_t heapAllocations = 0;
+        double jsonMs = 0.0;
+        std::pmr::vector<double> ttft, total, tps;
+
+        Aggregate(const std::string& r, std::pmr::memory_resource* arena)
+            : route(r.data(), r.size(), arena), ttft(arena), total(arena), tps(arena) {}
+    };
+    std::pmr::vector<Aggregate> routes(arena);
+    ledger.ForEach([&](const LedgerEntry& e) {
+        auto it = std::find_if(routes.begin(), routes.end(),
+                               [&](const Aggregate& r) { return std::string_view(r.route) == e.route; });
+        if (it == routes.end())
+            it = routes.emplace(routes.end(), e.route, arena);
+        Aggregate& a = *it;
+        a.requests++;
+        a.errors += e.status == "error";
+        a.promptTokens += std::max(e.promptTokens, 0);
+        a.completionTokens += std::max(e.completionTokens, 0);
+        a.cachedTokens += std::max(e.cachedTokens, 0);
+        a.bytes += e.bytesSent + e.bytesReceived;
+        a.retries += e.retries;
+        a.heapAllocations += e.heapAllocations;
+        a.jsonMs += e.jsonMs;
+        if (e.ttftMs >= 0.0f)
+            a.ttft.push_back(e.ttftMs);
+        if (e.status == "ok")
+            a.total.push_back(e.totalMs);
+        if (e.tokensPerSec > 0.0f)
+            a.tps.push_back(e.tokensPerSec);
+    });
+
+    if (ImGui::BeginTable("usage", 10, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+        ImGui::TableSetupColumn("Route");
+        ImGui::TableSetupColumn("Requests");
+        ImGui::TableSetupColumn("Errors");
+        ImGui::TableSetupColumn("Tokens in/out");
+        ImGui::TableSetupColumn("Cached");
+        ImGui::TableSetupColumn("TTFT p50/p95");
+        ImGui::TableSetupColumn("Total p50/p95");
+        ImGui::TableSetupColumn("tok/s p50");
+        ImGui::TableSetupColumn("KB / retries");
+        ImGui::TableSetupColumn("Allocs / JSON ms");
+        ImGui::TableHeadersRow();
+        for (Aggregate& a : routes) {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(a.route.empty() ? "-" : a.route.c_str());
+            ImGui::TableNextColumn();
+            ImGui::Text("%d", a.requests);
+            ImGui::TableNextColumn();
+            ImGui::Text("%d", a.errors);
+            ImGui::TableNextColumn();
+            ImGui::Text("%lld/%lld", a.promptTokens, a.completionTokens);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.0f%%", a.promptTokens > 0 ? 100.0 * a.cachedTokens / a.promptTokens : 0.0);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.0f/%.0f", Percentile(a.ttft, 0.5), Percentile(a.ttft, 0.95));
+            ImGui::TableNextColumn();
+            ImGui::Text("%.0f/%.0f", Percentile(a.total, 0.5), Percentile(a.total, 0.95));
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f", Percentile(a.tps, 0.5));
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f / %d", a.bytes / 1024.0, a.retries);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.0f / %.2f", (double)a.heapAllocations / a.requests, a.jsonMs / a.requests);
+        }
+        ImGui::EndTable();
+    }
+}
+
+// Compare mode: one column per route with its own reply and numbers.
+void RenderCompare(AppContext* ctx) {
+    {
+        std::lock_guard<std::mutex> lock(ctx->router.mutex);
+        ctx->compareRoutes.resize(ctx->router.routes.size(), 1);
+        ImGui::TextDisabled("Compare:");
+        for (size_t i = 0; i < ctx->router.routes.size(); i++) {
+            ImGui::SameLine();
+            bool ticked = ctx->compareRoutes[i] != 0;
+            ImGui::PushID((int)i);
+            if (ImGui::Checkbox(ctx->router.routes[i].name.c_str(), &ticked))
+                ctx->compareRoutes[i] = ticked;
+            ImGui::PopID();
+        }
+    }
+    ImGui::SameLine();
+    ImGui::Checkbox("First complete wins", &ctx->firstCompleteWins);
+
+    CompareSession* session = ctx->compare.get();
+    if (!session)
+        return;
+    std::lock_guard<std::mutex> lock(session->mutex);
+    ImGui::TextWrapped("> %s", session->prompt.c_str());
+    int n = (int)session->columns.size();
+    if (!ImGui::BeginTable("compare", n, ImGuiTableFlags_Borders | ImGuiTableFlags_Resizable |
+                                             ImGuiTableFlags_SizingStretchSame))
+        return;
+    for (const auto& col : session->columns)
+        ImGui::TableSetupColumn(col.name.c_str());
+    ImGui::TableHeadersRow();
+    ImGui::TableNextRow();
+    for (int i = 0; i < n; i++) {
+        const CompareColumn& col = session->columns[i];
+        ImGui::TableNextColumn();
+        if (session->winner == i)
+            ImGui::TextColored(ImVec4(0.6f, 1.0f, 0.6f, 1.0f), "winner");
+        else
+            ImGui::TextDisabled("%s", col.status.c_str());
+        if (col.ttftMs >= 0.0)
+            ImGui::TextDisabled("TTFT %.0f ms | %.1f tok/s", col.ttftMs, col.tokensPerSec);
+        if (col.usage.promptTokens >= 0)
+            ImGui::TextDisabled("%d prompt + %d completion tokens", col.usage.promptTokens,
+                                col.usage.completionTokens);
+        ImGui::Separator();
+        ImGui::TextWrapped("%s", col.text.c_str());
+    }
+    ImGui::EndTable();
+}
+#endif
+
+// Writes `report` as one tab-separated line per tag: tag, live bytes, peak
+// bytes, allocations, allocations per second.
+bool WriteMemoryReport(const MemoryReport& report, const char* path) {
+    std::ofstream out(path);
+    out << "# tag\tlive\tpeak\tallocations\tallocations/s\n";
+    for (int i = 0; i < (int)MemTag::Count; i++)
+        out << kMemTagNames[i] << '\t' << report.liveBytes[i] << '\t' << report.peakBytes[i] << '\t'
+            << report.allocations[i] << '\t' << report.allocationsPerSec[i] << '\n';
+    return (bool)out;
+}
+
+void RenderMemory(AppContext* ctx) {
+    if (!ImGui::CollapsingHeader("Memory"))
+        return;
+    MemoryReport& report = ctx->memory;
+    if (std::chrono::steady_clock::now() - report.taken >= std::chrono::seconds(1))
+        report = TakeMemoryReport(report);
+
+    if (ImGui::BeginTable("memory", 5, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+        ImGui::TableSetupColumn("Tag");
+        ImGui::TableSetupColumn("Live KB");
+        ImGui::TableSetupColumn("Peak KB");
+        ImGui::TableSetupColumn("Allocations");
+        ImGui::TableSetupColumn("Allocs/s");
+        ImGui::TableHeadersRow();
+        for (int i = 0; i < (int)MemTag::Count; i++) {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(kMemTagNames[i]);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f", report.liveBytes[i] / 1024.0);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f", report.peakBytes[i] / 1024.0);
+            ImGui::TableNextColumn();
+            ImGui::Text("%llu", (unsigned long long)report.allocations[i]);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.0f", report.allocationsPerSec[i]);
+        }
+        ImGui::EndTable();
+    }
+#ifndef _WEB_BUILD
+    if (ImGui::SmallButton("Dump memory")) {
+        const char* path = "memory.txt";
+        ctx->AddMessage("system", WriteMemoryReport(report, path) ? std::string("Memory report written to ") + path
+                                                                  : std::string("Could not write ") + path);
+    }
+#endif
+}
+
 void Render(AppContext* ctx) {
     ImGui::SetNextWindowPos(ImVec2(0, 0));
     ImGui::SetNextWindowSize(ImGui::GetIO().DisplaySize);
@@ -535,19 +6028,140 @@ void Render(AppContext* ctx) {
                  ImGuiWindowFlags_NoTitleBar | ImGuiWindowFlags_NoResize);
 
     ImGui::TextDisabled("OpenRouter C++ Client (Boost + ImGui)");
+    ImGui::SameLine();
+    ImGui::TextDisabled("| %llu heap allocations/frame", (unsigned long long)ctx->frameAllocations);
     ImGui::Separator();
 
     ImGui::SetNextItemWidth(300);
-    ImGui::InputTextWithHint("##key", "API Key (Required)", ctx->apiKeyBuffer,
+    ImGui::InputTextWithHint("##key", "API Key(s), comma separated", ctx->apiKeyBuffer,
                              sizeof(ctx->apiKeyBuffer),
                              ImGuiInputTextFlags_Password);
+#ifndef _WEB_BUILD
+    if (ImGui::IsItemDeactivatedAfterEdit() && ctx->apiKeyBuffer[0])
+        Prewarm(ctx);
+    ImGui::SameLine();
+    bool hedging = ctx->net.hedging;
+    if (ImGui::Checkbox("Hedge", &hedging))
+        ctx->net.hedging = hedging;
+    ImGui::SameLine();
+    ImGui::Checkbox("Compare", &ctx->compareMode);
+    ImGui::SameLine();
+    bool caching = ctx->net.cache.enabled;
+    if (ImGui::Checkbox("Cache", &caching))
+        ctx->net.cache.enabled = caching;
+    ImGui::SameLine();
+    bool prewarm = ctx->net.prewarm;
+    if (ImGui::Checkbox("Pre-warm", &prewarm))
+        ctx->net.prewarm = prewarm;
+    ImGui::SameLine();
+    bool recalling = ctx->recall.enabled;
+    if (ImGui::Checkbox("Recall", &recalling))
+        SetRecall(ctx, recalling);
+    if (ImGui::IsItemHovered()) {
+        std::lock_guard<std::mutex> lock(ctx->recall.mutex);
+        ImGui::SetTooltip("%zu embedded (%s), %zu queued, %u recalled%s%s", ctx->recall.index.hashes.size(),
+                          ctx->recall.index.model.c_str(), ctx->recall.pending.size(), ctx->recall.recalled.load(),
+                          ctx->recall.lastError.empty() ? "" : "\n", ctx->recall.lastError.c_str());
+    }
+    ImGui::SameLine();
+    if (GetTracer().enabled) {
+        if (ImGui::SmallButton("Save trace") && !GetTracer().Save())
+            ctx->AddMessage("system", "Could not write " + GetTracer().path);
+        ImGui::SameLine();
+    }
+    if (ImGui::SmallButton("Dump flight")) {
+        const char* path = GetFlightRecorder().path;
+        ctx->AddMessage("system", GetFlightRecorder().Dump() ? std::string("Flight recorder written to ") + path
+                                                             : std::string("Could not write ") + path);
+    }
+    ImGui::SameLine();
+    std::pmr::memory_resource* arena = &ctx->frame.resource;
+    ImGui::TextDisabled("TTFT p50 warm %.0f ms (%zu) / cold %.0f ms (%zu) | TLS resumed %u/%u",
+                        ctx->net.ttftWarm.Percentile(0.5, arena), ctx->net.ttftWarm.Count(),
+                        ctx->net.ttftCold.Percentile(0.5, arena), ctx->net.ttftCold.Count(),
+                        ctx->net.tlsResumed.load(), ctx->net.tlsHandshakes.load());
+    PromptCacheStats& promptCache = ctx->net.promptCache;
+    if (promptCache.promptTokens > 0)
+        ImGui::TextDisabled("Prompt cache: %.0f%% of prompt tokens | TTFT p50 hit %.0f ms (%zu) / miss %.0f ms (%zu)",
+                            promptCache.HitRate() * 100.0,
+                            promptCache.ttftHit.Percentile(0.5, arena), promptCache.ttftHit.Count(),
+                            promptCache.ttftMiss.Percentile(0.5, arena), promptCache.ttftMiss.Count());
+#endif
+    RenderRoutes(ctx->router);
+#ifndef _WEB_BUILD
+    RenderLedger(ctx->net.ledger, &ctx->frame.resource);
+#endif
+    RenderMemory(ctx);
+    RenderSearch(ctx);
 
     ImGui::Spacing();
+    bool regenerate = false;
     ImGui::BeginChild("History", ImVec2(0, -50), true);
+#ifndef _WEB_BUILD
+    if (ctx->compareMode)
+        RenderCompare(ctx);
+    else
+#endif
     {
-        std::lock_guard<std::mutex> lock(ctx->historyMutex);
-        for (const auto &m : ctx->history) {
-            RenderMessage(m);
+        TraceSpan span("history", "ui");
+        auto lock = TraceLock(ctx->historyMutex, "wait history");
+        // Branch switches are applied after the walk, which they would
+        // otherwise redirect halfway.
+        MessageNode* switchParent = nullptr;
+        size_t switchTo = 0;
+        ctx->history.ForEachActive([&](MessageNode& node) {
+            MessageNode& parent = *node.parent;
+            bool branched = parent.children.size() > 1;
+            bool editable = node.message.role == "user" && !ctx->isWaiting;
+            if (branched || editable) {
+                ImGui::PushID(&node);
+                if (branched) {
+                    if (ImGui::SmallButton("<") && parent.activeChild > 0) {
+                        switchParent = &parent;
+                        switchTo = parent.activeChild - 1;
+                    }
+                    ImGui::SameLine();
+                    ImGui::TextDisabled("%zu/%zu", parent.activeChild + 1, parent.children.size());
+                    ImGui::SameLine();
+                    if (ImGui::SmallButton(">") && parent.activeChild + 1 < parent.children.size()) {
+                        switchParent = &parent;
+                        switchTo = parent.activeChild + 1;
+                    }
+                    if (editable)
+                        ImGui::SameLine();
+                }
+                // Edit loads the prompt into the input box; sending it starts
+                // a branch beside this one.
+                if (editable && ctx->editing == &node) {
+                    if (ImGui::SmallButton("Cancel edit")) {
+                        memset(ctx->inputBuffer, 0, sizeof(ctx->inputBuffer));
+                        ctx->editing = nullptr;
+                    }
+                } else if (editable && ImGui::SmallButton("Edit")) {
+                    std::string_view text = node.message.content.View();
+                    size_t n = std::min(text.size(), sizeof(ctx->inputBuffer) - 1);
+                    memcpy(ctx->inputBuffer, text.data(), n);
+                    ctx->inputBuffer[n] = '\0';
+                    ctx->editing = &node;
+                }
+                ImGui::PopID();
+            }
+            if (&node == ctx->search.scrollTarget) {
+                ImGui::SetScrollHereY(0.0f);
+                ctx->search.scrollTarget = nullptr;
+            }
+            bool matched = std::binary_search(ctx->search.matched.begin(), ctx->search.matched.end(), &node);
+            RenderMessage(node.message, matched ? &ctx->search.terms : nullptr);
+        });
+        if (switchParent)
+            switchParent->activeChild = switchTo;
+#ifndef _WEB_BUILD
+        if (int queued = ctx->net.limiter.queued)
+            ImGui::TextDisabled("Rate limited, %d request(s) queued...", queued);
+#endif
+        if (!ctx->isWaiting && ctx->history.Leaf()->message.role == "assistant") {
+            if (ImGui::SmallButton("Regenerate"))
+                regenerate = true;
         }
         if (ctx->scrollToBottom) {
             ImGui::SetScrollHereY(1.0f);
@@ -555,6 +6169,8 @@ void Render(AppContext* ctx) {
         }
     }
     ImGui::EndChild();
+    if (regenerate)
+        RegenerateLast(ctx);
 
     ImGui::Separator();
     bool submit = false;
@@ -562,25 +6178,57 @@ void Render(AppContext* ctx) {
     if (ImGui::InputText("##input", ctx->inputBuffer, sizeof(ctx->inputBuffer),
                          ImGuiInputTextFlags_EnterReturnsTrue))
         submit = true;
+#ifndef _WEB_BUILD
+    if (ImGui::IsItemActivated() || ImGui::IsItemEdited())
+        Prewarm(ctx);
+#endif
     ImGui::PopItemWidth();
     ImGui::SameLine();
 
-    if (ctx->isWaiting) {
-        ImGui::Button("Fetching...", ImVec2(70, 0));
+    bool busy = ctx->isWaiting;
+#ifndef _WEB_BUILD
+    if (ctx->compareMode)
+        busy = ctx->compare && ctx->compare->running > 0;
+#endif
+    if (busy) {
+        if (ImGui::Button("STOP", ImVec2(70, 0))) {
+#ifndef _WEB_BUILD
+            if (ctx->compareMode)
+                ctx->compare->handle->cancelled = true;
+            else
+#endif
+                CancelRequest(ctx);
+        }
     } else {
         if (ImGui::Button("SEND", ImVec2(70, 0)))
             submit = true;
     }
 
-    if (submit && !ctx->isWaiting) {
-        SendMessage(ctx);
+    if (submit && !busy) {
+#ifndef _WEB_BUILD
+        if (ctx->compareMode)
+            SendCompare(ctx);
+        else
+#endif
+            SendMessage(ctx);
         ImGui::SetKeyboardFocusHere(-1);
     }
 
     ImGui::End();
 }
 
-int main(int, char **) {
+int main(int argc, char **argv) {
+#ifndef _WEB_BUILD
+    if (argc == 3 && std::string(argv[1]) == "--decode-flight")
+        return DecodeFlight(argv[2], std::cout) ? 0 : 1;
+    InstallFlightDumpHandlers();
+    // No window, GL context or ImGui in batch mode.
+    for (int i = 1; i < argc; i++)
+        if (std::string(argv[i]) == "--batch")
+            return RunBatch(argc, argv);
+        else if (std::string(argv[i]) == "--gateway")
+            return RunGateway(argc, argv);
+#endif
     if (SDL_Init(SDL_INIT_VIDEO) != 0)
         return -1;
 
@@ -598,6 +6246,9 @@ int main(int, char **) {
     SDL_GL_CreateContext(window);
 
     IMGUI_CHECKVERSION();
+    // ImGui's own buffers (vertices, draw lists, fonts) bypass operator new.
+    ImGui::SetAllocatorFunctions([](size_t size, void*) { return TaggedAlloc(size, MemTag::ImGui); },
+                                 [](void* p, void*) { TaggedFree(p); });
     ImGui::CreateContext();
 
     ApplyCoolStyle();
@@ -610,9 +6261,46 @@ int main(int, char **) {
     g_webContext = &ctx;
 #endif
 
+#ifndef _WEB_BUILD
+    CommonOptions options;
+    int metricsPort = 0;
+    std::string metricsFile;
+    for (int i = 1; i + 1 < argc; i++) {
+        std::string arg = argv[i];
+        if (options.Parse(argc, argv, i))
+            continue;
+        if (arg == "--metrics-port")
+            metricsPort = std::atoi(argv[++i]);
+        else if (arg == "--metrics-file")
+            metricsFile = argv[++i];
+    }
+    std::string routesError = LoadRoutes(ctx.router, options.routesPath);
+#else
+    std::string routesError = LoadRoutes(ctx.router, "routes.json");
+#endif
+    if (!routesError.empty())
+        ctx.AddMessage("system", "Could not load " + routesError);
+
+#ifndef _WEB_BUILD
+    GetTracer().NameThread("UI");
+    if (metricsPort > 0 || !metricsFile.empty()) {
+        std::string metricsError = ctx.metricsExporter.Start(metricsPort, metricsFile, [&ctx] {
+            return FormatMetrics(ctx.net, ctx.router);
+        });
+        if (!metricsError.empty())
+            ctx.AddMessage("system", "Could not start " + metricsError);
+    }
+#else
+    (void)argc;
+    (void)argv;
+#endif
+
     bool done = false;
 
     auto main_loop_iteration = [&]() {
+        std::uint64_t allocationsBefore = g_threadHeapAllocations;
+        TraceSpan frameSpan("frame", "ui");
+        std::optional<TraceSpan> span(std::in_place, "events", "ui");
         SDL_Event event;
         while (SDL_PollEvent(&event)) {
             ImGui_ImplSDL2_ProcessEvent(&event);
@@ -625,19 +6313,27 @@ int main(int, char **) {
             }
         }
 
+        span.emplace("new frame", "ui");
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplSDL2_NewFrame();
         ImGui::NewFrame();
 
+        span.emplace("build", "ui");
         Render(&ctx);
 
+        span.emplace("imgui render", "ui");
         ImGui::Render();
+        span.emplace("draw", "ui");
         glViewport(0, 0, (int)ImGui::GetIO().DisplaySize.x,
                    (int)ImGui::GetIO().DisplaySize.y);
         glClearColor(0.08f, 0.08f, 0.1f, 1);
         glClear(GL_COLOR_BUFFER_BIT);
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        span.emplace("swap", "ui");
         SDL_GL_SwapWindow(window);
+        span.reset();
+        ctx.frame.Reset();
+        ctx.frameAllocations = g_threadHeapAllocations - allocationsBefore;
     };
 
 #ifdef _WEB_BUILD
@@ -648,12 +6344,35 @@ int main(int, char **) {
         },
         &main_loop_iteration, 0, 1);
 #else
+    auto lastHistorySample = std::chrono::steady_clock::time_point{};
     while (!done) {
+        auto frameStart = std::chrono::steady_clock::now();
         main_loop_iteration();
+        auto frameEnd = std::chrono::steady_clock::now();
+        ctx.net.metrics.Local().frame.Observe(
+            kFrameBuckets, std::chrono::duration<double>(frameEnd - frameStart).count());
+        if (frameEnd - lastHistorySample >= std::chrono::seconds(1)) {
+            ctx.net.metrics.historyBytes = HistoryBytes(&ctx);
+            lastHistorySample = frameEnd;
+        }
+        ctx.net.pool.Prune();
         std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
 #endif
 
+    CancelRequest(&ctx);
+#ifndef _WEB_BUILD
+    if (ctx.compare)
+        ctx.compare->handle->cancelled = true;
+    // Cancelled requests notice within kCancelPollInterval, but still touch
+    // ctx on their way out.
+    while (ctx.requestThreads > 0)
+        std::this_thread::sleep_for(kCancelPollInterval);
+    ctx.metricsExporter.Stop();
+    if (GetTracer().enabled)
+        GetTracer().Save();
+#endif
+
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplSDL2_Shutdown();
     ImGui::DestroyContext();